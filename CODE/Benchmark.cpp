@@ -0,0 +1,338 @@
+// Benchmark suite: build throughput, per-operation insert/delete latency, query latency by spatial and
+// temporal width, and memory per record, on T-Drive, DSSN and two synthetic generators.
+//
+// Build: g++ -O2 -std=c++17 Benchmark.cpp -o Benchmark -ls2 -lbenchmark -lpthread
+// Run from CODE/:  ./Benchmark --benchmark_out=results.json --benchmark_out_format=json
+//   --benchmark_filter=Query/TDrive  runs a subset, --benchmark_repetitions=5 reports mean/median/stddev.
+// Every input is generated from fixed seeds, so two versions of TST.hpp are measured on identical work.
+#include <iostream>
+#include <random>
+#include <chrono>
+#include <ctime>
+#include <benchmark/benchmark.h>
+#include "../TST.hpp"
+
+typedef int ValueType;
+typedef TST::TST<ValueType> Index;
+
+static const int S2_LEVEL = 20;
+static const char* TIME_RES = "hour";
+static const size_t SYNTHETIC_RECORDS = 100000;
+static const int QUERIES_PER_SHAPE = 32; // Distinct queries cycled through by each query benchmark
+static const double DELETE_FRACTION = 0.1;
+
+struct Row {
+    int year, month, day, hour;
+    double lat, lng;
+};
+
+struct Dataset {
+    std::string name;
+    std::string path; // CSV file, empty for synthetic data
+    std::vector<Row> rows;
+    std::vector<Index::Record> records; // Encoded rows, value = line number
+    double lat_lo, lat_hi, lng_lo, lng_hi; // 1st to 99th percentile box, so outliers do not stretch query sizes
+    std::unique_ptr<Index> index; // Built on first use by the query benchmarks
+};
+
+static std::vector<std::unique_ptr<Dataset>> datasets;
+
+/* Inputs */
+static void encode(Dataset& data) {
+    Index codec(S2_LEVEL, TIME_RES);
+    std::vector<double> lats, lngs;
+    for (const Row& row : data.rows) { lats.push_back(row.lat); lngs.push_back(row.lng); }
+    std::sort(lats.begin(), lats.end());
+    std::sort(lngs.begin(), lngs.end());
+    size_t n = data.rows.size();
+    data.lat_lo = lats[n / 100]; data.lat_hi = lats[n - 1 - n / 100];
+    data.lng_lo = lngs[n / 100]; data.lng_hi = lngs[n - 1 - n / 100];
+
+    for (size_t k = 0; k < n; k++) {
+        const Row& row = data.rows[k];
+        data.records.emplace_back(codec.time_encoder(row.year, row.month, row.day, row.hour),
+                                  codec.space_encoder(row.lat, row.lng), (ValueType)(k + 1));
+    }
+}
+
+static bool load_file(const std::string& name, const std::string& path) {
+    std::unique_ptr<Dataset> data(new Dataset());
+    data->name = name;
+    data->path = path;
+    try {
+        TST::CSV_Loader loader(path);
+        for (TST::CSV_Loader::Chunk& chunk : loader.split()) { // Raw columns, to generate queries around the data
+            loader.parse(chunk);
+            for (size_t k = 0; k < chunk.lat.size(); k++) {
+                data->rows.push_back({chunk.fields[0][k], chunk.fields[1][k], chunk.fields[2][k], chunk.fields[3][k],
+                                      chunk.lat[k], chunk.lng[k]});
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Skipping " << name << ": " << e.what() << std::endl;
+        return false;
+    }
+    if (data->rows.empty()) return false;
+    encode(*data);
+    datasets.push_back(std::move(data));
+    return true;
+}
+
+static void generate(const std::string& name, int clusters, uint64_t seed) {
+    // One week of February 2008 over the T-Drive area; clusters = 0 spreads points uniformly,
+    // otherwise they fall around that many hotspots (about 1km wide)
+    std::unique_ptr<Dataset> data(new Dataset());
+    data->name = name;
+    std::mt19937_64 rng(seed);
+    std::uniform_real_distribution<double> lat(39.7, 40.1), lng(116.1, 116.7), unit(0, 1);
+    std::uniform_int_distribution<int> day(2, 8), hour(0, 23);
+    std::vector<std::pair<double, double>> centers;
+    for (int c = 0; c < clusters; c++) centers.emplace_back(lat(rng), lng(rng));
+    std::normal_distribution<double> spread(0, 0.01);
+
+    for (size_t k = 0; k < SYNTHETIC_RECORDS; k++) {
+        Row row = {2008, 2, day(rng), hour(rng), 0, 0};
+        if (clusters == 0) {
+            row.lat = lat(rng); row.lng = lng(rng);
+        } else {
+            const auto& center = centers[(size_t)(unit(rng) * clusters) % clusters];
+            row.lat = center.first + spread(rng); row.lng = center.second + spread(rng);
+        }
+        data->rows.push_back(row);
+    }
+    encode(*data);
+    datasets.push_back(std::move(data));
+}
+
+static Index& built_index(Dataset& data) {
+    if (!data.index) {
+        data.index.reset(new Index(S2_LEVEL, TIME_RES));
+        std::vector<Index::Record> records = data.records;
+        data.index->InsertBatch(records);
+    }
+    return *data.index;
+}
+
+/* Reporting */
+static void report_latency(benchmark::State& state, std::vector<double>& latency_ns) {
+    // Percentiles, plus a cumulative histogram in decades: lt_1us counts the operations faster than 1us, ...
+    if (latency_ns.empty()) return;
+    std::sort(latency_ns.begin(), latency_ns.end());
+    auto percentile = [&](double p) { return latency_ns[std::min(latency_ns.size() - 1, (size_t)(p * latency_ns.size()))]; };
+    state.counters["p50_ns"] = percentile(0.5);
+    state.counters["p90_ns"] = percentile(0.9);
+    state.counters["p99_ns"] = percentile(0.99);
+    state.counters["p999_ns"] = percentile(0.999);
+    state.counters["max_ns"] = latency_ns.back();
+
+    static const char* names[] = {"lt_1us", "lt_10us", "lt_100us", "lt_1ms"};
+    size_t k = 0;
+    double bound = 1000;
+    for (const char* name : names) {
+        while (k < latency_ns.size() && latency_ns[k] < bound) k++;
+        state.counters[name] = (double)k;
+        bound *= 10;
+    }
+    state.counters["ops"] = (double)latency_ns.size();
+}
+
+static void report_memory(benchmark::State& state, const Index& index) {
+    double count = std::max(1, index.get_DataCount());
+    state.counters["bytes_per_record"] = index.get_size() * 1024 * 1024 / count;
+    state.counters["payload_bytes_per_record"] = index.get_payload_size() * 1024 * 1024 / count;
+    state.counters["nodes"] = index.getTotal_NodeCount();
+}
+
+/* Build */
+static void BM_Build_Insert(benchmark::State& state, Dataset* data) {
+    for (auto _ : state) {
+        std::unique_ptr<Index> index(new Index(S2_LEVEL, TIME_RES));
+        for (const Index::Record& record : data->records)
+            index->Insert(std::get<0>(record), std::get<1>(record), std::get<2>(record));
+        state.PauseTiming();
+        report_memory(state, *index);
+        index.reset(); // Teardown is not part of the build
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * data->records.size());
+}
+
+static void BM_Build_InsertBatch(benchmark::State& state, Dataset* data) {
+    for (auto _ : state) {
+        state.PauseTiming();
+        std::vector<Index::Record> batch = data->records; // InsertBatch sorts in place
+        std::unique_ptr<Index> index(new Index(S2_LEVEL, TIME_RES));
+        state.ResumeTiming();
+        index->InsertBatch(batch);
+        state.PauseTiming();
+        index.reset();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * data->records.size());
+}
+
+static void BM_Build_BulkLoad(benchmark::State& state, Dataset* data) {
+    for (auto _ : state) {
+        std::unique_ptr<Index> index(new Index(S2_LEVEL, TIME_RES, data->records.begin(), data->records.end()));
+        state.PauseTiming();
+        report_memory(state, *index);
+        index.reset();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * data->records.size());
+}
+
+static void BM_Build_CSV(benchmark::State& state, Dataset* data) { // Parsing and encoding included
+    for (auto _ : state) {
+        std::unique_ptr<Index> index(new Index(S2_LEVEL, TIME_RES));
+        TST::CSV_Loader loader(data->path);
+        loader.load(*index, [](size_t record) { return (ValueType)record; });
+        state.PauseTiming();
+        index.reset();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * data->records.size());
+}
+
+/* Latency per operation */
+static void BM_Insert_Latency(benchmark::State& state, Dataset* data) {
+    std::vector<double> latency_ns;
+    for (auto _ : state) {
+        Index index(S2_LEVEL, TIME_RES);
+        for (const Index::Record& record : data->records) {
+            auto start = std::chrono::steady_clock::now();
+            index.Insert(std::get<0>(record), std::get<1>(record), std::get<2>(record));
+            latency_ns.push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count());
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * data->records.size());
+    report_latency(state, latency_ns);
+}
+
+static void BM_Delete_Latency(benchmark::State& state, Dataset* data) {
+    std::vector<size_t> victims(data->records.size());
+    for (size_t k = 0; k < victims.size(); k++) victims[k] = k;
+    std::shuffle(victims.begin(), victims.end(), std::mt19937_64(11));
+    victims.resize((size_t)(victims.size() * DELETE_FRACTION));
+
+    std::vector<double> latency_ns;
+    for (auto _ : state) {
+        state.PauseTiming();
+        Index index(S2_LEVEL, TIME_RES, data->records.begin(), data->records.end());
+        state.ResumeTiming();
+        for (size_t k : victims) {
+            const Index::Record& record = data->records[k];
+            auto start = std::chrono::steady_clock::now();
+            index.Delete(std::get<0>(record), std::get<1>(record), std::get<2>(record));
+            latency_ns.push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count());
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * victims.size());
+    report_latency(state, latency_ns);
+}
+
+/* Queries */
+struct Query {
+    TST::Spatial_Plan plan;
+    unsigned int start, end;
+};
+
+static unsigned int encode_hours_after(const Index& codec, const Row& row, int hours) {
+    std::tm t = {};
+    t.tm_year = row.year - 1900; t.tm_mon = row.month - 1; t.tm_mday = row.day; t.tm_hour = row.hour + hours;
+    time_t seconds = timegm(&t); // Normalizes day, month and year overflow
+    gmtime_r(&seconds, &t);
+    return const_cast<Index&>(codec).time_encoder(t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, t.tm_hour);
+}
+
+static std::vector<Query> make_queries(Dataset& data, int side_permille, int hours) {
+    // Rectangles side_permille / 1000 of the data's extent wide, and windows of some hours,
+    // both starting at a record picked at random so that every query lands near data
+    Index& index = built_index(data);
+    std::mt19937_64 rng(7919 * side_permille + hours);
+    std::uniform_int_distribution<size_t> pick(0, data.rows.size() - 1);
+    double half_lat = (data.lat_hi - data.lat_lo) * side_permille / 2000.0;
+    double half_lng = (data.lng_hi - data.lng_lo) * side_permille / 2000.0;
+
+    std::vector<Query> queries;
+    for (int q = 0; q < QUERIES_PER_SHAPE; q++) {
+        const Row& row = data.rows[pick(rng)];
+        std::vector<double> left_bottom = {row.lat - half_lat, row.lng - half_lng};
+        std::vector<double> right_upper = {row.lat + half_lat, row.lng + half_lng};
+        queries.push_back({index.REC_S2_FINDER(left_bottom, right_upper),
+                           encode_hours_after(index, row, 0), encode_hours_after(index, row, hours)});
+    }
+    return queries;
+}
+
+static void BM_Query(benchmark::State& state, Dataset* data) {
+    int side_permille = state.range(0), hours = state.range(1);
+    std::vector<Query> queries = make_queries(*data, side_permille, hours); // Coverings are not timed
+    Index& index = built_index(*data);
+
+    std::vector<double> latency_ns;
+    std::vector<ValueType> result;
+    size_t q = 0, hits = 0;
+    for (auto _ : state) {
+        const Query& query = queries[q++ % queries.size()];
+        result.clear();
+        auto start = std::chrono::steady_clock::now();
+        index.range_search(query.plan, query.start, query.end, result);
+        latency_ns.push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count());
+        hits += result.size();
+        benchmark::DoNotOptimize(result.data());
+    }
+    state.counters["results"] = benchmark::Counter((double)hits, benchmark::Counter::kAvgIterations);
+    state.counters["selectivity"] = benchmark::Counter((double)hits / data->records.size(), benchmark::Counter::kAvgIterations);
+    report_latency(state, latency_ns);
+}
+
+static void BM_Covering(benchmark::State& state, Dataset* data) { // REC_S2_FINDER alone, per rectangle size
+    Index& index = built_index(*data);
+    double half_lat = (data->lat_hi - data->lat_lo) * state.range(0) / 2000.0;
+    double half_lng = (data->lng_hi - data->lng_lo) * state.range(0) / 2000.0;
+    std::mt19937_64 rng(13);
+    std::uniform_int_distribution<size_t> pick(0, data->rows.size() - 1);
+    for (auto _ : state) {
+        const Row& row = data->rows[pick(rng)];
+        std::vector<double> left_bottom = {row.lat - half_lat, row.lng - half_lng};
+        std::vector<double> right_upper = {row.lat + half_lat, row.lng + half_lng};
+        TST::Spatial_Plan plan = index.REC_S2_FINDER(left_bottom, right_upper);
+        benchmark::DoNotOptimize(plan.size());
+    }
+}
+
+int main(int argc, char** argv) {
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) return 1;
+
+    load_file("TDrive", "../DATASETS/TDrive.txt");
+    load_file("DSSN", "../DATASETS/DSSN.txt");
+    generate("Uniform", 0, 1);
+    generate("Clustered", 16, 2);
+
+    for (auto& owned : datasets) {
+        Dataset* data = owned.get();
+        const std::string& name = data->name;
+        benchmark::RegisterBenchmark(("Build/Insert/" + name).c_str(), BM_Build_Insert, data)->Unit(benchmark::kMillisecond);
+        benchmark::RegisterBenchmark(("Build/InsertBatch/" + name).c_str(), BM_Build_InsertBatch, data)->Unit(benchmark::kMillisecond);
+        benchmark::RegisterBenchmark(("Build/BulkLoad/" + name).c_str(), BM_Build_BulkLoad, data)->Unit(benchmark::kMillisecond);
+        if (!data->path.empty())
+            benchmark::RegisterBenchmark(("Build/CSV/" + name).c_str(), BM_Build_CSV, data)->Unit(benchmark::kMillisecond);
+        benchmark::RegisterBenchmark(("Latency/Insert/" + name).c_str(), BM_Insert_Latency, data)->Iterations(3)->Unit(benchmark::kMillisecond);
+        benchmark::RegisterBenchmark(("Latency/Delete/" + name).c_str(), BM_Delete_Latency, data)->Iterations(3)->Unit(benchmark::kMillisecond);
+
+        // Spatial side in permille of the extent x temporal width in hours
+        benchmark::RegisterBenchmark(("Query/" + name).c_str(), BM_Query, data)
+            ->ArgNames({"side_permille", "hours"})
+            ->ArgsProduct({{5, 20, 100, 300}, {1, 6, 24, 168}})
+            ->Unit(benchmark::kMicrosecond);
+        benchmark::RegisterBenchmark(("Covering/" + name).c_str(), BM_Covering, data)
+            ->ArgName("side_permille")->Arg(5)->Arg(20)->Arg(100)->Arg(300)
+            ->Unit(benchmark::kMicrosecond);
+    }
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
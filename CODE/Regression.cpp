@@ -0,0 +1,58 @@
+#include <iostream>
+#include <atomic>
+#include <thread>
+#include <cstdio>
+#include "../TST.hpp"
+
+typedef int ValueType;
+
+static int failures = 0;
+
+static void check(bool ok, const char* what) {
+    std::cout << (ok ? "[PASS] " : "[FAIL] ") << what << std::endl;
+    if (!ok) failures++;
+}
+
+// A Delete that runs while a query is inside the trie leaves the removed nodes waiting for that query;
+// a snapshot taken afterwards must still load as a consistent (empty) index that accepts new records.
+static void delete_during_read_then_snapshot() {
+    const char* path = "regression_snapshot.tst";
+    TST::TST<ValueType> tst(20, "hour");
+    unsigned long long encoded_temp = tst.time_encoder(2008, 2, 2, 15);
+    unsigned long long encoded_spat = tst.space_encoder(39.921, 116.511);
+    tst.Insert(encoded_temp, encoded_spat, 10);
+
+    std::vector<double> left_bottom = {39.92, 116.51}, right_upper = {39.93, 116.52};
+    auto plan = tst.REC_S2_FINDER(left_bottom, right_upper);
+    std::atomic<bool> reading(false), deleted(false);
+    std::thread reader([&] {
+        tst.range_visit(plan, 0, ~0u, [&](const ValueType&) {
+            reading = true;
+            while (!deleted) std::this_thread::yield(); // Stay inside the query while the writer deletes
+            return true;
+        });
+    });
+    while (!reading) std::this_thread::yield();
+    tst.Delete(encoded_temp, encoded_spat, 10);
+    deleted = true;
+    reader.join();
+
+    tst.save(path);
+    TST::TST<ValueType> loaded(20, "hour");
+    loaded.load_snapshot(path);
+    std::remove(path);
+    check(loaded.get_DataCount() == 0 && loaded.getLeaf_NodeCount() == 0, "Reloaded index has no live leaves");
+
+    loaded.Insert(encoded_temp, encoded_spat, 20);
+    std::vector<ValueType> result;
+    loaded.range_search(plan, 0, ~0u, result);
+    check(result.size() == 1 && result[0] == 20, "Insert after reload is found again");
+}
+
+int main() {
+
+    std::cout << "====== TST: Regression Checks =====" << std::endl;
+    delete_during_read_then_snapshot();
+
+    return failures == 0 ? 0 : 1;
+}
@@ -1,60 +1,27 @@
 #include <iostream>
-#include <fstream>
-#include <sstream>
-#include <chrono>
 #include "../TST.hpp"
 
 typedef int ValueType;
 
 int main(){
 
-    std::ifstream file("../DATASETS/TDrive.txt");
-    if (!file) {
-        std::cerr << "Error: Could not open the file!" << std::endl;
-        return 1;
-    }
-
-    std::string line;
     TST::TST<ValueType> tst(20, "hour");
-    double cumulative_encoding_time = 0, cumulative_insertion_time = 0;
-    int year, month, day, hour; // Temporal
-    double latitude, longitude; // Spatial
-    int lineNum = 0; // Data
-    while (std::getline(file, line)) {
-        std::stringstream ss(line);
-        char comma;
-
-        ss >> year >> comma >> month >> comma >> day >> comma >> hour >> comma >> latitude >> comma >> longitude;
-
-        /* Encoding */
-        auto start_encoding = std::chrono::system_clock::now();
-        unsigned long long encoded_temp_insert = tst.time_encoder(year, month, day, hour);
-        unsigned long long encoded_spat_insert = tst.space_encoder(latitude, longitude);
-        auto end_encoding = std::chrono::system_clock::now();
-        cumulative_encoding_time += std::chrono::duration<double, std::milli>(end_encoding - start_encoding).count();
-
-        
-        auto start_insertion = std::chrono::system_clock::now();
-        tst.Insert(encoded_temp_insert, encoded_spat_insert, ++lineNum);
-        auto end_insertion = std::chrono::system_clock::now();
-        cumulative_insertion_time += std::chrono::duration<double, std::milli>(end_insertion - start_insertion).count();
-    }
+    TST::CSV_Loader loader("../DATASETS/TDrive.txt"); // year,month,day,hour,latitude,longitude per line
+    int lineNum = loader.load(tst, [](size_t record) { return (ValueType)record; }); // Data: the line number
 
     std::cout << "====== T-Drive: Trie Construction =====" << std::endl;
-    std::cout << ">> Data Encoding Elapsed Time: " << cumulative_encoding_time << " ms" << std::endl;
-    std::cout << ">> Index Building Elapsed Time (Node Insertion + Data Pointing): " << cumulative_insertion_time << " ms" << std::endl;
+    std::cout << ">> Parsing + Data Encoding Elapsed Time: " << loader.getParse_time() << " ms" << std::endl;
+    std::cout << ">> Index Building Elapsed Time (Node Insertion + Data Pointing): " << loader.getInsert_time() << " ms" << std::endl;
     std::cout << "	# of Internal Nodes: " << tst.getInter_NodeCount() << std::endl;
     std::cout << "	# of Leaf Nodes: " << tst.getLeaf_NodeCount() << std::endl;
     std::cout << "	# of Total Tree Nodes: " << tst.getTotal_NodeCount() << std::endl << std::endl;
-    file.close();
 
     std::cout << "====== T-Drive: Node Deletion =====" << std::endl;
     std::cout << ">> Delete Last IoT Data Record" << std::endl;
 
     std::cout << "	# of IoT Data (Before Deletion): " << tst.get_DataCount() << std::endl;
-    auto encoded_temp_delete = tst.time_encoder(year, month, day, hour);
-    auto encoded_spat_delete = tst.space_encoder(latitude, longitude);
-    tst.Delete(encoded_temp_delete, encoded_spat_delete, lineNum);
+    auto last_key = loader.last_key(); // Encoded (time, space) of the last line
+    tst.Delete(last_key.first, last_key.second, lineNum);
     std::cout << "	# of IoT Data (After Deletion): " << tst.get_DataCount() << std::endl << std::endl;
 
     std::cout << "====== T-Drive: Query Execution =====" << std::endl;
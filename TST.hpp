@@ -3,18 +3,53 @@
 
 #include <string>
 #include <stack>
+#include <queue>
+#include <list>
+#include <unordered_map>
 #include <tuple>
 #include <algorithm>
 #include <sstream>
 #include <stdexcept>
+#include <memory>
+#include <thread>
+#include <fstream>
+#include <cstdio>
+#include <cstdint>
+#include <cmath>
+#include <cstring>
+#include <cerrno>
+#include <type_traits>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
+#include <functional>
+#include <charconv>
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include "s2/s2cell.h"
+#include "s2/s2edge_distances.h"
 #include "s2/s2loop.h"
+#include "s2/s2polyline.h"
 #include "s2/s2region_term_indexer.h"
 
 
 namespace TST {
 
 static const int POINTER_NULL_INT = -1;
+static const int DATA_INLINE_SIZE = 4;  // # of values stored inside a spatial leaf
+static const int DATA_CHUNK_SIZE = 16;  // # of values per overflow chunk
+static const double PLAN_DESCENT_COST = 4; // A cell in a query plan costs about as much as scanning this many values
+
+// Links a reader may follow while the writer runs are published with release stores
+// and read with acquire loads, so a reader never reaches a node before its contents.
+inline int load_link(const int& link) { return __atomic_load_n(&link, __ATOMIC_ACQUIRE); }
+inline void publish_link(int& link, int idx) { __atomic_store_n(&link, idx, __ATOMIC_RELEASE); }
 
 /* Node Definition */
 class NodeBase {
@@ -29,11 +64,14 @@ public:
 	Node_T() {
 		child[0] = child[1]	= POINTER_NULL_INT;
 	}
+
+	int& free_link() { return child[0]; } // Next dead slot while on the free list
 };
 
 class Linked_Node : public NodeBase { // The leaf of the temporal trie
 public:
 	unsigned int ENCODED_TIME;
+	unsigned int count; // # of values in the time bin
 	int child[8];
 
 	struct {
@@ -41,7 +79,7 @@ public:
 		int next; // future
 	};
 
-	Linked_Node() : ENCODED_TIME(0) {
+	Linked_Node() : ENCODED_TIME(0), count(0) {
         prev = next = POINTER_NULL_INT;
 		for (int i = 0; i < 8; ++i) {
             child[i] = POINTER_NULL_INT;
@@ -51,32 +89,327 @@ public:
 	bool operator<(const Linked_Node& other) const {
         return ENCODED_TIME < other.ENCODED_TIME;
     }
+
+	int& free_link() { return child[0]; } // Next dead slot while on the free list
 };
 
 class Node_S : public NodeBase {
 public:
 	int child[4];
+	unsigned int count; // # of values in the S2 cell below this node
 
-	Node_S() {
+	Node_S() : count(0) {
 		child[0] = child[1] = child[2] = child[3] = POINTER_NULL_INT;
 	}
+
+	int& free_link() { return child[0]; } // Next dead slot while on the free list
+};
+
+template<class DATA>
+class Data_Chunk : public NodeBase { // Overflow block of a spatial leaf's payload
+public:
+	DATA data[DATA_CHUNK_SIZE];
+	int next;
+
+	Data_Chunk() : data(), next(POINTER_NULL_INT) {}
+
+	int& free_link() { return next; } // Next dead chunk while on the free list
+};
+
+/* Node Pool */
+template<class NODE>
+class Node_Pool { // Flat node array; dead slots are threaded into a free list
+public:
+	// Each pool reserves address space once and commits pages as it grows, so the array
+	// stays contiguous and a node never moves while a reader may be looking at it.
+	static const size_t DEFAULT_RESERVE_BYTES = (size_t)1 << 32; // 4 GiB of address space, not memory
+
+	explicit Node_Pool(size_t reserve_bytes = DEFAULT_RESERVE_BYTES) : base(nullptr), reserved(0), committed(0), count(0),
+				free_head(POINTER_NULL_INT), free_count(0), sealed(0), reserve_limit(reserve_bytes) {}
+	~Node_Pool() { unmap(); }
+	Node_Pool(const Node_Pool&) = delete;
+	Node_Pool& operator=(const Node_Pool&) = delete;
+	Node_Pool(Node_Pool&& other) noexcept : base(nullptr), reserved(0) { take(other); }
+	Node_Pool& operator=(Node_Pool&& other) noexcept {
+		if (this != &other) {
+			unmap();
+			take(other);
+		}
+		return *this;
+	}
+
+	NODE& operator[](size_t idx) { return base[idx]; }
+	const NODE& operator[](size_t idx) const { return base[idx]; }
+
+	int allocate() {
+		if (free_head == POINTER_NULL_INT) {
+			return append();
+		}
+		// Reuse the most recently reclaimed slot
+		int idx = free_head;
+		free_head = base[idx].free_link();
+		base[idx].free_link() = POINTER_NULL_INT;
+		free_count--;
+		return idx;
+	}
+
+	int append() { // Allocate at the tail, bypassing the free list
+		commit(count + 1);
+		new (&base[count]) NODE();
+		return count++;
+	}
+
+	// A released slot is kept intact until reclaim(): a reader may still stand on it.
+	void release(int idx) {
+		limbo.push_back(std::make_pair(0, idx));
+	}
+
+	void seal(uint64_t epoch) { // Tag the slots released since the last seal
+		for (size_t i = sealed; i < limbo.size(); i++) limbo[i].first = epoch;
+		sealed = limbo.size();
+	}
+
+	void reclaim(uint64_t safe_epoch) { // Recycle sealed slots older than every active reader
+		size_t n = 0;
+		for (; n < sealed && limbo[n].first < safe_epoch; n++) {
+			int idx = limbo[n].second;
+			base[idx] = NODE(); // Dead slots are reset, so they hold no children and no data
+			base[idx].free_link() = free_head;
+			free_head = idx;
+			free_count++;
+		}
+		limbo.erase(limbo.begin(), limbo.begin() + n);
+		sealed -= n;
+	}
+
+	void reserve(size_t n) {
+		commit(n);
+	}
+
+	void set_reserve(size_t bytes) { // Address space to reserve the next time the pool is mapped (after clear())
+		reserve_limit = bytes;
+	}
+	size_t reserve_size() const { return reserve_limit; }
+
+	void clear() {
+		unmap();
+		count = 0;
+		free_head = POINTER_NULL_INT;
+		free_count = 0;
+		std::vector<std::pair<uint64_t, int>>().swap(limbo);
+		sealed = 0;
+	}
+
+	/* For Snapshot */
+	void assign(const NODE* src, size_t n, int head, int dead) { // Copy slots into owned storage
+		clear();
+		commit(n);
+		std::uninitialized_copy(src, src + n, base);
+		count = n;
+		free_head = head;
+		free_count = dead;
+	}
+
+	void view(NODE* mapped, size_t n, int head, int dead) { // Serve slots from external (mapped) memory
+		clear();
+		base = mapped;
+		count = n;
+		free_head = head;
+		free_count = dead;
+	}
+
+	// Slots still waiting in limbo are saved as free: no reader of the loaded index can stand on them.
+	// write(offset, source, length) receives the slots in increasing offset order.
+	template<class WRITE>
+	void write_slots(uint64_t offset, WRITE write) const {
+		std::vector<int> held;
+		for (const auto& entry : limbo) held.push_back(entry.second);
+		std::sort(held.begin(), held.end());
+		size_t done = 0;
+		for (size_t k = 0; k < held.size(); k++) {
+			size_t idx = held[k];
+			write(offset + done * sizeof(NODE), base + done, (idx - done) * sizeof(NODE));
+			NODE slot;
+			slot.free_link() = (k + 1 < held.size()) ? held[k + 1] : free_head;
+			write(offset + idx * sizeof(NODE), &slot, sizeof(NODE));
+			done = idx + 1;
+		}
+		write(offset + done * sizeof(NODE), base + done, (count - done) * sizeof(NODE));
+	}
+	int saved_free_head() const { // Free list head once the limbo slots are chained in front of it
+		if (limbo.empty()) return free_head;
+		int head = limbo.front().second;
+		for (const auto& entry : limbo) head = std::min(head, entry.second);
+		return head;
+	}
+	int saved_dead() const { return free_count + limbo.size(); }
+
+	const NODE* data() const { return base; }
+	int free_list_head() const { return free_head; }
+
+	size_t size() const { return count; } // # of slots (live + dead)
+	size_t live() const { return count - free_count - limbo.size(); } // # of live nodes
+	int dead() const { return free_count; } // # of slots on the free list
+	size_t capacity() const { return committed / sizeof(NODE); } // # of slots backed by memory
+	size_t get_bytes() const { return committed; }
+
+private:
+	void commit(size_t n) { // Make slots [0, n) writable
+		size_t bytes = n * sizeof(NODE);
+		if (bytes <= committed) return;
+		size_t page = sysconf(_SC_PAGESIZE);
+		if (!reserved) {
+			// Under an address-space limit (ulimit -v) a pool asks for at most 1/16 of what is still free,
+			// and a refused reservation is retried at half the size down to what is needed now
+			size_t want = reserve_limit;
+			struct rlimit limit;
+			if (getrlimit(RLIMIT_AS, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+				size_t used = 0;
+				if (FILE* statm = fopen("/proc/self/statm", "r")) {
+					unsigned long pages;
+					if (fscanf(statm, "%lu", &pages) == 1) used = pages * page;
+					fclose(statm);
+				}
+				want = std::min<size_t>(want, (limit.rlim_cur > used ? limit.rlim_cur - used : 0) / 16);
+			}
+			size_t need = (bytes + page - 1) / page * page;
+			want = std::max(need, want / page * page);
+			void* region;
+			while ((region = mmap(nullptr, want, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0)) == MAP_FAILED) {
+				if (want == need) throw std::bad_alloc();
+				want = std::max(need, want / 2 / page * page);
+			}
+			base = static_cast<NODE*>(region);
+			reserved = want;
+		}
+		if (bytes > reserved) {
+			throw std::length_error("Node pool exhausted its reserved address space (see TST::set_pool_reserve).");
+		}
+
+		// Grow geometrically in whole pages
+		size_t target = std::max(bytes, std::max<size_t>(committed * 2, 16 * page));
+		target = std::min(reserved, (target + page - 1) / page * page);
+		if (mprotect(reinterpret_cast<char*>(base) + committed, target - committed, PROT_READ | PROT_WRITE) != 0) {
+			throw std::bad_alloc();
+		}
+		committed = target;
+	}
+
+	void unmap() {
+		if (reserved) {
+			if (!std::is_trivially_destructible<NODE>::value) {
+				for (size_t i = 0; i < count; i++) base[i].~NODE(); // Dead slots hold default nodes, also constructed
+			}
+			munmap(base, reserved);
+		}
+		base = nullptr;
+		reserved = committed = 0;
+	}
+
+	void take(Node_Pool& other) {
+		base = other.base;
+		reserved = other.reserved;
+		committed = other.committed;
+		count = other.count;
+		free_head = other.free_head;
+		free_count = other.free_count;
+		limbo = std::move(other.limbo);
+		sealed = other.sealed;
+		reserve_limit = other.reserve_limit;
+		other.base = nullptr;
+		other.reserved = other.committed = other.count = 0;
+		other.free_head = POINTER_NULL_INT;
+		other.free_count = 0;
+		other.limbo.clear();
+		other.sealed = 0;
+	}
+
+	NODE* base; // Slot storage: the reserved region, or a snapshot mapping
+	size_t reserved, committed; // Bytes of address space / bytes made writable (0 for a mapping)
+	size_t count;
+	int free_head, free_count;
+	std::vector<std::pair<uint64_t, int>> limbo; // (epoch, slot) released but not yet reusable
+	size_t sealed; // # of limbo entries already tagged with an epoch
+	size_t reserve_limit; // Bytes of address space to ask for
+};
+
+template<class DATA>
+class Data_Arena : public Node_Pool<Data_Chunk<DATA>> { // Owns every overflow chunk of a tree's spatial leaves
+public:
+	using Node_Pool<Data_Chunk<DATA>>::Node_Pool;
+
+	// A sequence lock over the values of every leaf: odd while the writer rewrites a slot that a reader
+	// holding an older count may be copying. Readers copy a run of slots and retry it if the sequence moved.
+	// Values that are not trivially copyable cannot be copied while they change, so for those a rewrite
+	// and a reader's copy exclude each other through a spin lock instead.
+	void rewrite(DATA& slot, const DATA& value) {
+		if constexpr (LOCKED) {
+			lock();
+			slot = value;
+			unlock();
+		} else {
+			__atomic_store_n(&rewrites, rewrites + 1, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_RELEASE);
+			slot = value;
+			__atomic_store_n(&rewrites, rewrites + 1, __ATOMIC_RELEASE);
+		}
+		shrunk = true;
+	}
+
+	void fill(DATA& slot, const DATA& value) { // A slot at or past the count; only a count read before an erase reaches it
+		if (shrunk) rewrite(slot, value);
+		else slot = value;
+	}
+
+	void copy_slots(const DATA* src, unsigned n, DATA* dst) const {
+		if constexpr (LOCKED) {
+			lock();
+			std::copy(src, src + n, dst);
+			unlock();
+			return;
+		}
+		while (true) {
+			unsigned before = __atomic_load_n(&rewrites, __ATOMIC_ACQUIRE);
+			if (before & 1) continue;
+			std::copy(src, src + n, dst);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&rewrites, __ATOMIC_RELAXED) == before) return;
+		}
+	}
+
+private:
+	static constexpr bool LOCKED = !std::is_trivially_copyable<DATA>::value;
+
+	void lock() const {
+		while (__atomic_exchange_n(&busy, true, __ATOMIC_ACQUIRE)) std::this_thread::yield();
+	}
+	void unlock() const { __atomic_store_n(&busy, false, __ATOMIC_RELEASE); }
+
+	unsigned rewrites = 0;
+	mutable bool busy = false; // Held by a rewrite or a copy of values that are not trivially copyable
+	bool shrunk = false; // Set by the first erase; until then no slot below a reader's count is ever written
 };
 
 template<class DATA>
 class Data_Node : public NodeBase {
 public:
 	unsigned int ENCODED_TIME;
+	unsigned int data_count; // # of stored values (inline + overflow)
 	unsigned long long S2_ID;
-	std::vector<DATA>* data_vector_ptr;
 
 	struct {
 		int prev; // past
 		int next; // future
 	};
 
-	Data_Node() {
+	// The first DATA_INLINE_SIZE values live inside the leaf itself,
+	// the rest spill into a chain of Data_Chunk owned by the tree's Data_Arena.
+	int chunk_head, chunk_tail;
+	DATA inline_data[DATA_INLINE_SIZE];
+
+	Data_Node() : ENCODED_TIME(0), data_count(0), S2_ID(0) {
 		prev = next = POINTER_NULL_INT;
-		data_vector_ptr = new std::vector<DATA>();
+		chunk_head = chunk_tail = POINTER_NULL_INT;
 	}
 
 	bool operator<(const Data_Node<DATA>& other) const {
@@ -92,359 +425,1602 @@ public:
         return other < *this;
     }
 
-	/* For Data Vector */
-	void insert_data(const DATA& data) {
-        data_vector_ptr->push_back(data);
+	int& free_link() { return next; } // Next dead slot while on the free list
+
+	/* For Data Payload */
+	void insert_data(const DATA& data, Data_Arena<DATA>& chunk_pool) {
+		if (data_count < DATA_INLINE_SIZE) {
+			chunk_pool.fill(inline_data[data_count], data);
+			__atomic_store_n(&data_count, data_count + 1, __ATOMIC_RELEASE); // Readers see the value before the count
+			return;
+		}
+
+		// Move to the next chunk when the tail chunk is full (or does not exist yet).
+		// A chunk emptied by erase_data is still on the chain and is reused in place.
+		unsigned offset = (data_count - DATA_INLINE_SIZE) % DATA_CHUNK_SIZE;
+		if (offset == 0) {
+			int& link = (chunk_tail == POINTER_NULL_INT) ? chunk_head : chunk_pool[chunk_tail].next;
+			int CHUNK_IDX = link;
+			if (CHUNK_IDX == POINTER_NULL_INT) {
+				CHUNK_IDX = chunk_pool.allocate();
+				chunk_pool[CHUNK_IDX].data[0] = data; // Filled before it is linked
+				publish_link(link, CHUNK_IDX);
+			}
+			else chunk_pool.fill(chunk_pool[CHUNK_IDX].data[0], data);
+			chunk_tail = CHUNK_IDX;
+		}
+		else chunk_pool.fill(chunk_pool[chunk_tail].data[offset], data);
+		__atomic_store_n(&data_count, data_count + 1, __ATOMIC_RELEASE);
     }
 
-	void get_data(std::vector<DATA>& retrieved_data_vector) {
-		if (data_vector_ptr) {
-            // Collect the queried data
-            retrieved_data_vector.insert(
-                retrieved_data_vector.end(),
-                data_vector_ptr->begin(),
-                data_vector_ptr->end()
-            );
-        }
+	void get_data(std::vector<DATA>& retrieved_data_vector, const Data_Arena<DATA>& chunk_pool) const {
+		// Collect the queried data
+		unsigned count = __atomic_load_n(&data_count, __ATOMIC_ACQUIRE);
+		if (count <= DATA_INLINE_SIZE) {
+			DATA copied[DATA_INLINE_SIZE];
+			chunk_pool.copy_slots(inline_data, count, copied);
+			retrieved_data_vector.insert(retrieved_data_vector.end(), copied, copied + count);
+			return;
+		}
+		size_t base = retrieved_data_vector.size();
+		retrieved_data_vector.resize(base + count);
+		DATA* out = retrieved_data_vector.data() + base;
+		visit_runs(count, chunk_pool, [&](unsigned first, const DATA* run, unsigned n) { chunk_pool.copy_slots(run, n, out + first); });
         return;
     }
 
-	size_t size() const {
-		return data_vector_ptr ? data_vector_ptr->size() : 0;
+	template<class FN>
+	void for_each_data(const Data_Arena<DATA>& chunk_pool, FN fn) const { // fn(const DATA&) on every stored value, in get_data's order
+		// The runs are copied last one first (see visit_runs), so the whole leaf is copied before fn sees any of it
+		unsigned count = __atomic_load_n(&data_count, __ATOMIC_ACQUIRE);
+		DATA copied_buf[DATA_INLINE_SIZE + DATA_CHUNK_SIZE];
+		std::vector<DATA> copied_heap;
+		DATA* copied = copied_buf;
+		if (count > DATA_INLINE_SIZE + DATA_CHUNK_SIZE) {
+			copied_heap.resize(count);
+			copied = copied_heap.data();
+		}
+		visit_runs(count, chunk_pool, [&](unsigned first, const DATA* run, unsigned n) { chunk_pool.copy_slots(run, n, copied + first); });
+		for (unsigned i = 0; i < count; i++) fn(copied[i]);
 	}
-};
 
-/* Tree Definition */
-template<class DATA>
-class TST {
-private:
-	static const int REF_YEAR = 2000;
-	static const int ROOT_IDX = 0;
-	int MAXCELL = 10000;
-	int  D_TEMP_LEAF = 0, D_SPAT_LEAF = 0, D_INTER = 0;
+	unsigned load_count() const { return __atomic_load_n(&data_count, __ATOMIC_ACQUIRE); }
 
-	int temp_len;
-	int spat_len;
-	int total_len;
-	int s2_level; // selected S2 level
-	unsigned TEMP_INTER_IDX, TEMP_LEAF_IDX, SPAT_INTER_IDX, SPAT_LEAF_IDX;
-	
-	enum{LEFT_CHILD, RIGHT_CHILD}; // temporal child index
-	enum{CHILD_ZERO, CHILD_ONE, CHILD_TWO, CHILD_THIRD, // spatial child index
-		  CHILD_FOURTH, CHILD_FIFTH, CHILD_SIXTH, CHILD_SEVENTH};
+	// Hands out the stored values in place as fn(first, n) runs: the inline slots, then each chunk.
+	// Stops as soon as fn returns false (and then returns false itself). Not validated against the
+	// arena's sequence lock: a concurrent erase_data may rewrite a slot while fn reads it.
+	template<class FN>
+	bool for_each_span(const Data_Arena<DATA>& chunk_pool, FN fn) const {
+		unsigned count = __atomic_load_n(&data_count, __ATOMIC_ACQUIRE);
+		unsigned n = std::min<unsigned>(count, DATA_INLINE_SIZE);
+		if (n > 0 && !fn(static_cast<const DATA*>(inline_data), static_cast<size_t>(n))) return false;
+		unsigned remain = count - n;
+		for (int c = load_link(chunk_head); remain > 0; c = load_link(chunk_pool.data()[c].next)) {
+			n = std::min<unsigned>(remain, DATA_CHUNK_SIZE);
+			if (!fn(static_cast<const DATA*>(chunk_pool.data()[c].data), static_cast<size_t>(n))) return false;
+			remain -= n;
+		}
+		return true;
+	}
 
-	std::vector<Node_T> temp_internal;
-	std::vector<Linked_Node> temp_leaf;
-	std::vector<Node_S> spat_internal;
-	std::vector<Data_Node<DATA>> spat_leaf;
+	// Visits slots [0, count) as fn(first slot, run, n), one run per chunk and one for the inline slots.
+	// erase_data only moves values towards lower slots, so runs are read from the last one down: a value
+	// moved meanwhile is met at its old or its new slot.
+	template<class FN>
+	void visit_runs(unsigned count, const Data_Arena<DATA>& chunk_pool, FN fn) const {
+		unsigned n_inline = std::min<unsigned>(count, DATA_INLINE_SIZE);
+		unsigned n_chunks = (count - n_inline + DATA_CHUNK_SIZE - 1) / DATA_CHUNK_SIZE;
+		if (n_chunks > 0) {
+			int chain_buf[8];
+			std::vector<int> chain_heap;
+			int* chain = chain_buf;
+			if (n_chunks > 8) {
+				chain_heap.resize(n_chunks);
+				chain = chain_heap.data();
+			}
+			const Data_Chunk<DATA>* chunks = chunk_pool.data();
+			unsigned reached = 0;
+			for (int c = load_link(chunk_head); reached < n_chunks; c = load_link(chunks[c].next))
+				chain[reached++] = c; // The chain only grows while the leaf lives
 
-	int trav_temp(unsigned int);
-	void trav_spat(std::map<int, std::vector<unsigned long long>>, int, std::vector<DATA>&);
+			for (unsigned k = n_chunks; k-- > 0;) {
+				unsigned first = n_inline + k * DATA_CHUNK_SIZE;
+				fn(first, static_cast<const DATA*>(chunks[chain[k]].data), std::min<unsigned>(count - first, DATA_CHUNK_SIZE));
+			}
+		}
+		if (n_inline > 0) fn(0u, static_cast<const DATA*>(inline_data), n_inline);
+	}
 
-public:
-	TST(); 
-	TST(int, const std::string&);
-	
-	template<typename... Args>
-	unsigned int time_encoder(Args...);
-	unsigned long long space_encoder(double, double);
-	void Insert(unsigned int, unsigned long long, DATA);
-	void Delete(unsigned int, unsigned long long, DATA);
+	// Removes one matching value; the last stored value fills the hole under the arena's sequence lock.
+	// A concurrent reader of this leaf may see the moved value twice, never miss it or a torn copy (see get_data).
+	bool erase_data(const DATA& data, Data_Arena<DATA>& chunk_pool) {
+		DATA* target = nullptr;
+		unsigned n_inline = std::min<unsigned>(data_count, DATA_INLINE_SIZE);
+		for (unsigned i = 0; i < n_inline && !target; i++) {
+			if (inline_data[i] == data) target = &inline_data[i];
+		}
 
-	std::map<int, std::vector<unsigned long long>> REC_S2_FINDER(std::vector<double>&, std::vector<double>&);
-	void range_search(std::map<int, std::vector<unsigned long long>>&, 
-									unsigned int, unsigned int, std::vector<DATA>& res);
+		unsigned remain = data_count - n_inline;
+		for (int c = chunk_head; c != POINTER_NULL_INT && remain > 0 && !target; c = chunk_pool[c].next) {
+			unsigned n = std::min<unsigned>(remain, DATA_CHUNK_SIZE);
+			for (unsigned i = 0; i < n; i++) {
+				if (chunk_pool[c].data[i] == data) {
+					target = &chunk_pool[c].data[i];
+					break;
+				}
+			}
+			remain -= n;
+		}
+		if (!target) return false;
 
-	void setMaxCells(int); // Setter for max # of S2 cells
-	int getInter_NodeCount() const; // Getter for # of Internal Nodes
-	int getLeaf_NodeCount() const; // Getter for # of Leaf Nodes
-	int getTotal_NodeCount() const; // Getter for # of Tree Nodes
-	int getTemp_len() const; // Getter for Encoded Temporal Bit length
-	int getSpat_len() const; // Getter for Encoded Spatial Bit length
-	int getTotal_len() const; // Getter for Encoded Total Bit length
-	int get_DataCount() const; // Getter for Total Data Count
-	double get_size() const; // Getter for Index size
+		// Move the last value into the hole, then shrink the count
+		unsigned last = data_count - 1;
+		if (last < DATA_INLINE_SIZE) {
+			chunk_pool.rewrite(*target, inline_data[last]);
+			__atomic_store_n(&data_count, last, __ATOMIC_RELEASE);
+			return true;
+		}
+		unsigned offset = (last - DATA_INLINE_SIZE) % DATA_CHUNK_SIZE;
+		chunk_pool.rewrite(*target, chunk_pool[chunk_tail].data[offset]);
+		__atomic_store_n(&data_count, last, __ATOMIC_RELEASE);
+
+		// Step back once the tail chunk is empty. The chunk stays on the chain for the next insert_data:
+		// a chain is never cut and relinked while the leaf lives, so a reader holding the old count
+		// only ever meets slots of this leaf. release_payload() returns the chain with the leaf.
+		if (offset == 0) {
+			if (chunk_head == chunk_tail) chunk_tail = POINTER_NULL_INT;
+			else {
+				int c = chunk_head;
+				while (chunk_pool[c].next != chunk_tail) c = chunk_pool[c].next;
+				chunk_tail = c;
+			}
+		}
+		return true;
+	}
+
+	void release_payload(Data_Arena<DATA>& chunk_pool) { // Hands every chunk of the chain back to the arena
+		for (int c = chunk_head; c != POINTER_NULL_INT; c = chunk_pool[c].next)
+			chunk_pool.release(c);
+	}
+
+	// Copies the overflow chain into another arena (the old chain is left untouched)
+	void move_payload(const Data_Arena<DATA>& src_pool, Data_Arena<DATA>& dst_pool) {
+		int c = chunk_head;
+		unsigned remain = data_count - std::min<unsigned>(data_count, DATA_INLINE_SIZE);
+		chunk_head = chunk_tail = POINTER_NULL_INT;
+		for (; remain > 0; c = src_pool[c].next) {
+			remain -= std::min<unsigned>(remain, DATA_CHUNK_SIZE);
+			int CHUNK_IDX = dst_pool.allocate();
+			std::copy(src_pool[c].data, src_pool[c].data + DATA_CHUNK_SIZE, dst_pool[CHUNK_IDX].data);
+			if (chunk_tail == POINTER_NULL_INT) chunk_head = CHUNK_IDX;
+			else dst_pool[chunk_tail].next = CHUNK_IDX;
+			chunk_tail = CHUNK_IDX;
+		}
+	}
+
+	size_t size() const {
+		return data_count;
+	}
 };
 
+/* Utility */
+template<class ITER, class COMPARE>
+void parallel_stable_sort(ITER first, ITER last, COMPARE comp) {
+	// Sorts one run per hardware thread, then merges neighbouring runs pairwise
+	size_t n = last - first;
+	size_t n_threads = std::max(1u, std::thread::hardware_concurrency());
+	if(n < (1u << 16) || n_threads == 1){
+		std::stable_sort(first, last, comp);
+		return;
+	}
 
-template<class DATA> // Minimum S2 Level is 1 and Time resolution is year
-TST<DATA>::TST() : temp_len(6), spat_len(6), total_len(12), s2_level(1),
-					TEMP_INTER_IDX(ROOT_IDX + 1), TEMP_LEAF_IDX(0), SPAT_INTER_IDX(0), SPAT_LEAF_IDX(0) {
-	temp_internal.emplace_back(Node_T()); // Add ROOT Node
-}
+	size_t run = (n + n_threads - 1) / n_threads;
+	std::vector<ITER> bounds;
+	for(size_t b = 0; b < n; b += run) bounds.push_back(first + b);
+	bounds.push_back(last);
 
-template<class DATA>
-TST<DATA>::TST(int s2_res, const std::string& t_res){
-	if (s2_res < 1 || s2_res > 30) {
-        throw std::invalid_argument("Invalid spatial resolution (first argument). Must be between 1 and 30.");
-    }
-	
-	s2_level = s2_res;
-    spat_len = s2_level * 2 + 4;
+	std::vector<std::thread> workers;
+	for(size_t k = 0; k + 1 < bounds.size(); k++){
+		workers.emplace_back([=]() { std::stable_sort(bounds[k], bounds[k + 1], comp); });
+	}
+	for(auto& worker : workers) worker.join();
 
-    // Validate and assign temporal resolution using switch-like logic
-    if (t_res == "year") {
-        temp_len = 6;
-    } else if (t_res == "month") {
-        temp_len = 10;
-    } else if (t_res == "day") {
-        temp_len = 15;
-    } else if (t_res == "hour") {
-        temp_len = 20;
-    } else if (t_res == "minute") {
-        temp_len = 26;
-    } else if (t_res == "second") {
-        temp_len = 32;
-    } else {
-        throw std::invalid_argument("Invalid temporal resolution (second argument). Must be one of: year, month, day, hour, minute, second.");
-    }
-	total_len = temp_len + spat_len;
+	while(bounds.size() > 2){
+		std::vector<ITER> merged;
+		workers.clear();
+		for(size_t k = 0; k + 2 < bounds.size(); k += 2){
+			workers.emplace_back([=]() { std::inplace_merge(bounds[k], bounds[k + 1], bounds[k + 2], comp); });
+			merged.push_back(bounds[k]);
+		}
+		if((bounds.size() - 1) % 2 == 1) merged.push_back(bounds[bounds.size() - 2]); // Odd run waits for the next round
+		merged.push_back(last);
+		for(auto& worker : workers) worker.join();
+		bounds.swap(merged);
+	}
+}
 
-	temp_internal.emplace_back(Node_T()); // Add ROOT Node
-	TEMP_INTER_IDX = ROOT_IDX + 1;
-	TEMP_LEAF_IDX = SPAT_INTER_IDX = SPAT_LEAF_IDX = 0;
+inline void hilbert_lookup_cell(int level, int i, int j, int orig, int pos, int orient, uint16_t* table) {
+	static const int POS_TO_IJ[4][4] = {{0, 1, 3, 2}, {0, 2, 3, 1}, {3, 2, 0, 1}, {3, 1, 0, 2}};
+	static const int POS_TO_ORIENTATION[4] = {1, 0, 0, 3}; // Swap, none, none, invert | swap
+	if(level == 4){
+		table[(i << 6) + (j << 2) + orig] = (uint16_t)((pos << 2) + orient);
+		return;
+	}
+	const int* ij = POS_TO_IJ[orient];
+	for(int k = 0; k < 4; k++){
+		hilbert_lookup_cell(level + 1, (i << 1) + (ij[k] >> 1), (j << 1) + (ij[k] & 1),
+							orig, (pos << 2) + k, orient ^ POS_TO_ORIENTATION[k], table);
+	}
 }
 
-template<class DATA>
-template<typename... Args>
-unsigned int TST<DATA>::time_encoder(Args... args) {
-    int expected_args = 0;
-    const std::string arg_list[] = {"year", "month", "day", "hour", "minute", "second"};
-	const int bit_lengths[] = {6, 4, 5, 5, 6, 6};
+inline const uint16_t* hilbert_lookup() {
+	// S2's table from 4 bits of i, 4 bits of j and an orientation to 8 bits of Hilbert position and the next orientation
+	static const std::vector<uint16_t> table = [] {
+		std::vector<uint16_t> t(1 << 10);
+		for(int orient = 0; orient < 4; orient++) hilbert_lookup_cell(0, 0, 0, orient, 0, orient, t.data());
+		return t;
+	}();
+	return table.data();
+}
 
-    switch (temp_len) {
-        case 6:  expected_args = 1; break; // year
-        case 10: expected_args = 2; break; // year, month
-        case 15: expected_args = 3; break; // year, month, day
-        case 20: expected_args = 4; break; // year, month, day, hour
-        case 26: expected_args = 5; break; // year, month, day, hour, minute
-        case 32: expected_args = 6; break; // year, month, day, hour, minute, second
-        default:
-            throw std::invalid_argument("Invalid temporal resolution. Cannot determine required arguments.");
-    }
 
-    // Validate the number of temporal arguments
-    if (sizeof...(args) != expected_args) {
-		std::string required_args;
-        for (int i = 0; i < expected_args; ++i) {
-            if (!required_args.empty()) {
-                required_args += ", ";
-            }
-            required_args += arg_list[i];
-        }
+/* Epoch Reclamation */
+static const int MAX_READERS = 64; // # of readers that can be inside a tree at the same time
 
-        throw std::invalid_argument(
-            "Expected " + std::to_string(expected_args + 2) + " arguments (longitude, latitude, " + 
-            required_args + "), but got " + std::to_string(sizeof...(args) + 2) + "."
-        );
-    }
+class Reader_Epochs { // Tells the single writer when no reader can still hold a released slot
+public:
+	Reader_Epochs() : global(1), high_water(0) {
+		for (int i = 0; i < MAX_READERS; i++) slots[i].epoch.store(0, std::memory_order_relaxed);
+	}
 
-	/* Temporal Encoding */
-	unsigned int encoded_temporal = 0;
-	int acc_length = 0;
-    int idx = 0;
+	int enter() { // Announce the current epoch in a free slot; returns the slot
+		uint64_t now = global.load();
+		while (true) {
+			for (int i = 0; i < MAX_READERS; i++) {
+				uint64_t idle = 0;
+				if (slots[i].epoch.compare_exchange_strong(idle, now)) {
+					int seen = high_water.load();
+					while (seen <= i && !high_water.compare_exchange_weak(seen, i + 1)) {}
+					return i;
+				}
+			}
+			std::this_thread::yield(); // Every slot is taken
+		}
+	}
 
-	([&](const auto& arg) {
-        uint8_t bit_length = bit_lengths[idx];
-        uint8_t value = static_cast<uint8_t>(arg);
-		if(idx == 0) value = value - REF_YEAR; //  the reference year is subtracted
-		acc_length += bit_length;
+	void exit(int slot) {
+		slots[slot].epoch.store(0, std::memory_order_release);
+	}
 
-		// Convert value to binary string and keep only the required bits (temp_len bits)
-		encoded_temporal += (value << (temp_len - acc_length));
-        ++idx;
-    }(args), ...);
+	uint64_t advance() { // Close the current epoch and return it
+		return global.fetch_add(1);
+	}
 
-	/* Return Encoded Temporal Information */
-    return encoded_temporal;
-}
+	uint64_t oldest() const { // Oldest epoch a reader may still be in
+		std::atomic_thread_fence(std::memory_order_seq_cst); // Unlinks before the scan
+		uint64_t min_epoch = global.load();
+		int n = high_water.load();
+		for (int i = 0; i < n; i++) {
+			uint64_t e = slots[i].epoch.load();
+			if (e != 0 && e < min_epoch) min_epoch = e;
+		}
+		return min_epoch;
+	}
 
-template<class DATA>
-unsigned long long TST<DATA>::space_encoder(double lat, double lng) {
-	/* Spatial Encoding: S2Geometry */
-	S2LatLng latlng = S2LatLng::FromDegrees(lat, lng);
-	S2CellId cell_id = S2CellId(latlng);
-	S2CellId selected_cell_id = cell_id.parent(s2_level);
+private:
+	struct alignas(64) Slot {
+		std::atomic<uint64_t> epoch; // 0 while free
+	};
 
-	// Convert value to binary string and keep only the required bits (spat_len bits)
-	unsigned long long encoded_spatial = selected_cell_id.id() >> (64 - spat_len);
-	
-	return encoded_spatial;
-}
+	std::atomic<uint64_t> global;
+	std::atomic<int> high_water; // Slots at or above this index were never used
+	Slot slots[MAX_READERS];
+};
 
-template<class DATA>
-void TST<DATA>::Insert(unsigned int encoded_temp, unsigned long long encoded_spat, DATA data) {
-	/* Temporal Node Insertion */
-	int i, LAST_ITER, LAST_BIT, bit = 0;
-	unsigned LAST_IDX, u = ROOT_IDX;
+class Read_Section { // RAII reader registration for the duration of one query
+public:
+	explicit Read_Section(Reader_Epochs& e) : epochs(e), slot(e.enter()) {}
+	~Read_Section() { epochs.exit(slot); }
+	Read_Section(const Read_Section&) = delete;
+	Read_Section& operator=(const Read_Section&) = delete;
 
-	// 1 - Search for the existence of a path in the trie with a time prefix.
-	for(i = 1; i <= temp_len; i++){
-		bit = (encoded_temp >> (temp_len - i)) & 1;
-		if(temp_internal[u].child[bit] == POINTER_NULL_INT){
-			LAST_ITER = i;
-			LAST_BIT = bit;
-			LAST_IDX = u;
-			break;
+private:
+	Reader_Epochs& epochs;
+	int slot;
+};
+
+/* Located Payload */
+template<class VALUE>
+struct Located { // A value stored with its own position, so queries can drop hits outside the region (refinement)
+	int32_t lat_e7, lng_e7; // Degrees * 1e7
+	VALUE value;
+
+	Located() : lat_e7(0), lng_e7(0), value() {}
+	Located(double lat, double lng, const VALUE& v)
+		: lat_e7((int32_t)std::lround(lat * 1e7)), lng_e7((int32_t)std::lround(lng * 1e7)), value(v) {}
+
+	double lat() const { return lat_e7 * 1e-7; }
+	double lng() const { return lng_e7 * 1e-7; }
+	S2Point point() const { return S2LatLng::FromDegrees(lat(), lng()).ToPoint(); }
+
+	bool operator==(const Located& other) const {
+		return lat_e7 == other.lat_e7 && lng_e7 == other.lng_e7 && value == other.value;
+	}
+};
+
+template<class T> struct is_located : std::false_type {};
+template<class VALUE> struct is_located<Located<VALUE>> : std::true_type {};
+
+/* Query Regions */
+class Polyline_Buffer : public S2Region { // Points within a distance of a polyline
+public:
+	// Each test measures the distance to every edge directly, so its cost follows the number of
+	// vertices and not the ratio of edge length to radius. A cell is inside when its bounding cap
+	// lies within radius of one edge (conservative).
+	Polyline_Buffer(const S2Polyline& polyline, S1Angle radius) : radius(radius), reach(radius) {
+		if(!(radius.radians() > 0)){
+			throw std::invalid_argument("Polyline buffer radius must be positive.");
 		}
-		u = temp_internal[u].child[bit];
+		for(int i = 0; i < polyline.num_vertices(); i++) vertices.push_back(polyline.vertex(i));
+		if(vertices.size() == 1) vertices.push_back(vertices[0]); // A single point is a zero-length edge
+		bound = polyline.GetRectBound().ExpandedByDistance(radius);
 	}
 
-	// 2 - add path to time prefix
-	if(i != temp_len+1){
-		for(; i <= temp_len; i++){
-			bit = (encoded_temp >> (temp_len - i)) & 1;
-			if(i != temp_len){
-				temp_internal[u].child[bit] = TEMP_INTER_IDX;
-				temp_internal.emplace_back(Node_T());
-				TEMP_INTER_IDX++;
+	Polyline_Buffer* Clone() const override { return new Polyline_Buffer(*this); }
+	S2Cap GetCapBound() const override { return GetRectBound().GetCapBound(); }
+	S2LatLngRect GetRectBound() const override { return bound; }
+	bool Contains(const S2Cell& cell) const override {
+		S2Cap cap = cell.GetCapBound();
+		return any_edge([&](const S2Point& a, const S2Point& b) {
+			return S2::GetDistance(cap.center(), a, b) + cap.GetRadius() <= radius;
+		});
+	}
+	bool MayIntersect(const S2Cell& cell) const override {
+		return any_edge([&](const S2Point& a, const S2Point& b) { return cell.GetDistance(a, b) <= reach; });
+	}
+	bool Contains(const S2Point& p) const override {
+		return any_edge([&](const S2Point& a, const S2Point& b) { return S2::GetDistance(p, a, b) <= radius; });
+	}
+
+private:
+	template<class FN>
+	bool any_edge(FN fn) const {
+		for(size_t i = 0; i + 1 < vertices.size(); i++){
+			if(fn(vertices[i], vertices[i + 1])) return true;
+		}
+		return false;
+	}
+
+	S1Angle radius;
+	S1ChordAngle reach; // radius, in the form S2Cell distances are returned in
+	std::vector<S2Point> vertices;
+	S2LatLngRect bound;
+};
+
+/* Query Plan */
+class Spatial_Plan { // An S2 covering compiled once per query and evaluated against every time bin
+public:
+	// The cells' 2-bit digits merged into a prefix tree with one root per face (lead 3 bits).
+	// Children are visited in digit order, i.e. in S2 (Hilbert) order; a cell has no children.
+	struct Step {
+		int child[4];
+		bool cell;
+		bool interior; // The cell lies entirely inside the query region
+		int level;
+		unsigned long long s2; // The cell's id shifted to the tree's spatial key length
+	};
+
+	Spatial_Plan() : spat_len(0), s2_level(0), hash(0) {
+		std::fill(face, face + 8, POINTER_NULL_INT);
+	}
+
+	// level_map: S2 cell ids grouped by level, as built by S2RegionCoverer
+	Spatial_Plan(const std::map<int, std::vector<unsigned long long>>& level_map, int s2_res, int key_len)
+		: spat_len(key_len), s2_level(s2_res) {
+		std::fill(face, face + 8, POINTER_NULL_INT);
+		for(const auto& LEVEL_S2_PAIR : level_map){
+			if(LEVEL_S2_PAIR.first < 0 || LEVEL_S2_PAIR.first > s2_level){
+				throw std::invalid_argument("S2 cell level of the query is outside [0, the index's S2 level].");
 			}
-			else{
-				temp_internal[u].child[bit] = TEMP_LEAF_IDX;
-				temp_leaf.emplace_back(Linked_Node());
-				TEMP_LEAF_IDX++;
+			for(unsigned long long id : LEVEL_S2_PAIR.second) add(id, LEVEL_S2_PAIR.first);
+		}
+		std::sort(ids.begin(), ids.end());
+
+		hash = spat_len;
+		for(unsigned long long id : ids){ // splitmix64 over the sorted cells
+			hash += id + 0x9e3779b97f4a7c15ULL;
+			hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+			hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+			hash ^= hash >> 31;
+		}
+	}
+
+	int root(int lead_3bits) const { return face[lead_3bits]; }
+	const Step& operator[](int idx) const { return steps[idx]; }
+
+	bool empty() const { return ids.empty(); }
+	size_t size() const { return ids.size(); }
+	void mark_interior(unsigned long long id, int level) { // No effect unless the cell itself is planned
+		int u = find(id, level);
+		if(u != POINTER_NULL_INT) steps[u].interior = true;
+	}
+	bool interior(unsigned long long id, int level) const {
+		int u = find(id, level);
+		return u != POINTER_NULL_INT && steps[u].interior;
+	}
+	const std::vector<unsigned long long>& cells() const { return ids; } // Raw S2 ids in Hilbert order
+	int getSpat_len() const { return spat_len; }
+	uint64_t fingerprint() const { return hash; } // Equal cells give equal fingerprints
+
+private:
+	int find(unsigned long long id, int level) const { // Step of a planned cell
+		unsigned long long s2 = id >> (64 - spat_len);
+		int u = face[s2 >> (spat_len - 3) & 0b111];
+		for(int j = 1; j <= level && u != POINTER_NULL_INT && !steps[u].cell; j++)
+			u = steps[u].child[(s2 >> (spat_len - 3 - 2*j)) & 0b11];
+		return (u != POINTER_NULL_INT && steps[u].cell && steps[u].level == level) ? u : POINTER_NULL_INT;
+	}
+
+	int make_step() {
+		Step step;
+		std::fill(step.child, step.child + 4, POINTER_NULL_INT);
+		step.cell = false;
+		step.interior = false;
+		step.level = 0;
+		step.s2 = 0;
+		steps.push_back(step);
+		return steps.size() - 1;
+	}
+
+	void add(unsigned long long id, int level) {
+		unsigned long long s2 = id >> (64 - spat_len);
+		int lead_3bits = s2 >> (spat_len - 3) & 0b111;
+		if(face[lead_3bits] == POINTER_NULL_INT) face[lead_3bits] = make_step();
+
+		int u = face[lead_3bits];
+		for(int j = 1; j <= level; j++){
+			if(steps[u].cell) return; // Inside a cell that is already planned
+			int bit = (s2 >> (spat_len - 3 - 2*j)) & 0b11;
+			if(steps[u].child[bit] == POINTER_NULL_INT){
+				int v = make_step();
+				steps[u].child[bit] = v;
 			}
-			u = temp_internal[u].child[bit];
+			u = steps[u].child[bit];
 		}
+		if(steps[u].cell) return;
 
-		temp_leaf[u].ENCODED_TIME = encoded_temp;
+		// Smaller cells already planned inside are covered by this one
+		const int* child = steps[u].child;
+		if(std::any_of(child, child + 4, [](int c) { return c != POINTER_NULL_INT; })){
+			unsigned long long lsb = 1ULL << (2 * (30 - level)); // Lowest set bit of a cell id at this level
+			ids.erase(std::remove_if(ids.begin(), ids.end(), [&](unsigned long long other) {
+				return other > id - lsb && other < id + lsb;
+			}), ids.end());
+			std::fill(steps[u].child, steps[u].child + 4, POINTER_NULL_INT);
+		}
+		steps[u].cell = true;
+		steps[u].level = level;
+		steps[u].s2 = s2;
+		ids.push_back(id);
+	}
 
-		// 3 - Update the node into the doubly linked list based on ENCODED_TIME
-		switch (temp_leaf.size() - D_TEMP_LEAF) {
-			case 1:
-				break;
-			case 2: {
-				int FIRST_IDX = 0;
-				if (temp_leaf[FIRST_IDX] < temp_leaf[u]) {
-					temp_leaf[FIRST_IDX].next = u;
-					temp_leaf[u].prev = FIRST_IDX;
-				} else {
-					temp_leaf[FIRST_IDX].prev = u;
-					temp_leaf[u].next = FIRST_IDX;
-				}
-				break;
+	int spat_len, s2_level;
+	uint64_t hash;
+	int face[8];
+	std::vector<Step> steps;
+	std::vector<unsigned long long> ids;
+};
+
+class Plan_Batch { // The cells of many plans merged into one prefix tree, for TST::range_search_batch
+public:
+	struct Step {
+		int child[4];
+		int level;
+		unsigned long long s2; // The cell's spatial key, if a plan has it
+		int owners; // First (plan, next) entry of owner_list for the plans that have this cell
+	};
+
+	Plan_Batch(const std::vector<const Spatial_Plan*>& plans, int s2_res, int key_len)
+		: n_plans(plans.size()), spat_len(key_len), s2_level(s2_res) {
+		std::fill(face, face + 8, POINTER_NULL_INT);
+		for(int q = 0; q < (int)plans.size(); q++){
+			if(plans[q]->getSpat_len() != spat_len && !plans[q]->empty()){
+				throw std::invalid_argument("The plan was compiled for an index with a different S2 level.");
 			}
-			default: { // More than 2 nodes
-				int PREV_IDX = POINTER_NULL_INT;
-				int NEXT_IDX = POINTER_NULL_INT;
-				unsigned v = u;
+			for(unsigned long long id : plans[q]->cells()) add(q, id);
+		}
+	}
 
-				if(LAST_BIT == 0){
-					unsigned left_most_idx = temp_internal[LAST_IDX].child[1];
-					for(int j = LAST_ITER + 1; j <= temp_len; j++){
-						if(temp_internal[left_most_idx].child[0] != POINTER_NULL_INT)
-							left_most_idx = temp_internal[left_most_idx].child[0];
-						else
-							left_most_idx = temp_internal[left_most_idx].child[1];
-					}
-					NEXT_IDX = left_most_idx;
-					PREV_IDX = temp_leaf[NEXT_IDX].prev;
-				}
-				else{
-					unsigned right_most_idx = temp_internal[LAST_IDX].child[0];
-					for(int j = LAST_ITER + 1; j <= temp_len; j++){
-						if(temp_internal[right_most_idx].child[1] != POINTER_NULL_INT)
-							right_most_idx = temp_internal[right_most_idx].child[1];
-						else
-							right_most_idx = temp_internal[right_most_idx].child[0];
-					}
-					PREV_IDX = right_most_idx;
-					NEXT_IDX = temp_leaf[PREV_IDX].next;
-				}
+	int root(int lead_3bits) const { return face[lead_3bits]; }
+	size_t size() const { return n_plans; }
+	int getSpat_len() const { return spat_len; }
 
-				temp_leaf[v].prev = PREV_IDX;
-				temp_leaf[v].next = NEXT_IDX;
+	std::vector<Step> steps; // A child always comes after its parent
+	std::vector<std::pair<int, int>> owner_list;
 
-				// Update prev node
-				if(PREV_IDX != POINTER_NULL_INT){
-					temp_leaf[PREV_IDX].next = v;
-				}
+private:
+	int make_step(int level) {
+		Step step;
+		std::fill(step.child, step.child + 4, POINTER_NULL_INT);
+		step.level = level;
+		step.s2 = 0;
+		step.owners = POINTER_NULL_INT;
+		steps.push_back(step);
+		return steps.size() - 1;
+	}
 
-				// Update next node
-				if(NEXT_IDX != POINTER_NULL_INT){
-					temp_leaf[NEXT_IDX].prev = v;
-				}
-				break;
+	void add(int plan, unsigned long long id) {
+		int level = S2CellId(id).level();
+		unsigned long long s2 = id >> (64 - spat_len);
+		int lead_3bits = s2 >> (spat_len - 3) & 0b111;
+		if(face[lead_3bits] == POINTER_NULL_INT) face[lead_3bits] = make_step(0);
+
+		int u = face[lead_3bits];
+		for(int j = 1; j <= level; j++){
+			int bit = (s2 >> (spat_len - 3 - 2*j)) & 0b11;
+			if(steps[u].child[bit] == POINTER_NULL_INT){
+				int v = make_step(j);
+				steps[u].child[bit] = v;
 			}
+			u = steps[u].child[bit];
 		}
+		steps[u].s2 = s2;
+		owner_list.push_back(std::make_pair(plan, steps[u].owners));
+		steps[u].owners = owner_list.size() - 1;
 	}
 
-	// 4 - Search for the existence of a path in the trie with a space suffix.
-	// 4-1 - Check the leading 3 bits.
-	int lead_3bits = (encoded_spat >> (spat_len - 3)) & 0b111;
-	LAST_ITER = -1;
-	if(temp_leaf[u].child[lead_3bits] == POINTER_NULL_INT) {
-		temp_leaf[u].child[lead_3bits] = SPAT_INTER_IDX;
-		spat_internal.emplace_back(Node_S());
-		SPAT_INTER_IDX++;
+	size_t n_plans;
+	int spat_len, s2_level;
+	int face[8];
+};
+
+/* Query Cache */
+template<class DATA>
+class Query_Cache { // LRU of per-bin range_search results, keyed by (plan fingerprint, encoded bin time)
+public:
+	explicit Query_Cache(size_t capacity) : capacity(capacity), held(0), clock(0), floor(0), idle(0), hits(0), misses(0) {}
+
+	// Appends the bin's cached values and returns true; otherwise returns false and the generation
+	// the caller's result must be stored under.
+	bool lookup(uint64_t plan, unsigned int bin, std::vector<DATA>& res, uint64_t& generation) {
+		std::lock_guard<std::mutex> guard(lock);
+		auto it = entries.find(Key(plan, bin));
+		if(it != entries.end()){
+			if(it->second->generation == generation_of(bin)){
+				lru.splice(lru.begin(), lru, it->second); // Most recently used first
+				res.insert(res.end(), it->second->values.begin(), it->second->values.end());
+				generation = it->second->generation;
+				hits++;
+				return true;
+			}
+			drop(it);
+		}
+		generation = track(bin, floor)->second.stamp; // Writes from now on must reach the pending store
+		misses++;
+		return false;
 	}
-	u = temp_leaf[u].child[lead_3bits];
 
-	// 4-2 - Check in 2-bit increments
-	for(i = 1; i <= s2_level; i++){
-		bit = (encoded_spat >> (spat_len - 3 - 2*i)) & 0b11;
-		if(spat_internal[u].child[bit] == POINTER_NULL_INT){
-			if(i >= 2){
-				LAST_ITER = i;
-				LAST_BIT = bit;
-				LAST_IDX = u;
+	void store(uint64_t plan, unsigned int bin, uint64_t generation, const DATA* first, size_t n) {
+		if(n > capacity) return;
+		std::lock_guard<std::mutex> guard(lock);
+		if(generation != generation_of(bin)) return; // The writer changed the bin during the traversal
+		Key key(plan, bin);
+		if(track(bin, generation)->second.entries++ == 0) idle--; // Counted first so dropping an older result keeps the bin
+		auto it = entries.find(key);
+		if(it != entries.end()) drop(it);
+		lru.push_front(Entry{key, generation, std::vector<DATA>(first, first + n)});
+		entries[key] = lru.begin();
+		held += n;
+		while(held > capacity) drop(entries.find(lru.back().key));
+	}
+
+	void invalidate(unsigned int bin) { // The writer changed the bin
+		std::lock_guard<std::mutex> guard(lock);
+		auto b = bins.find(bin);
+		if(b != bins.end()) b->second.stamp = ++clock;
+		else floor = ++clock; // Untracked bins share one stamp; no pending store can be stale
+	}
+
+	void clear() {
+		std::lock_guard<std::mutex> guard(lock);
+		entries.clear();
+		lru.clear();
+		bins.clear();
+		held = idle = 0;
+		floor = ++clock; // Results computed before the clear never match again
+	}
+
+	size_t hit_count() const { return hits; }
+	size_t miss_count() const { return misses; }
+
+private:
+	struct Key {
+		uint64_t plan;
+		unsigned int bin;
+		Key(uint64_t p, unsigned int b) : plan(p), bin(b) {}
+		bool operator==(const Key& other) const { return plan == other.plan && bin == other.bin; }
+	};
+	struct Key_Hash {
+		size_t operator()(const Key& key) const { return key.plan ^ (key.bin * 0x9e3779b97f4a7c15ULL); }
+	};
+	struct Entry {
+		Key key;
+		uint64_t generation;
+		std::vector<DATA> values;
+	};
+	struct Bin {
+		uint64_t stamp; // Clock of the last write, or the floor when first tracked
+		size_t entries; // 0: only a lookup is pending
+	};
+	typedef typename std::unordered_map<unsigned int, Bin>::iterator Bin_Iter;
+
+	uint64_t generation_of(unsigned int bin) const {
+		auto it = bins.find(bin);
+		return it == bins.end() ? floor : it->second.stamp;
+	}
+	Bin_Iter track(unsigned int bin, uint64_t stamp) { // stamp: not older than the bin's last write
+		auto it = bins.find(bin);
+		if(it != bins.end()) return it;
+		if(idle > bins.size() - idle + 64) sweep(); // Lookups whose store never came
+		idle++;
+		return bins.emplace(bin, Bin{stamp, 0}).first;
+	}
+	void untrack(Bin_Iter b) { // Folding a stamp into the floor keeps every generation handed out valid
+		floor = std::max(floor, b->second.stamp);
+		bins.erase(b);
+	}
+	void sweep() {
+		for(auto b = bins.begin(); b != bins.end();){
+			auto next = std::next(b);
+			if(b->second.entries == 0) untrack(b);
+			b = next;
+		}
+		idle = 0;
+	}
+	void drop(typename std::unordered_map<Key, typename std::list<Entry>::iterator, Key_Hash>::iterator it) {
+		auto b = bins.find(it->first.bin);
+		if(--b->second.entries == 0) untrack(b);
+		held -= it->second->values.size();
+		lru.erase(it->second);
+		entries.erase(it);
+	}
+
+	size_t capacity, held; // # of values
+	uint64_t clock, floor; // floor: stamp of every bin not in bins
+	size_t idle; // # of bins tracked for a pending lookup only
+	size_t hits, misses;
+	std::mutex lock;
+	std::list<Entry> lru;
+	std::unordered_map<Key, typename std::list<Entry>::iterator, Key_Hash> entries;
+	std::unordered_map<unsigned int, Bin> bins; // Bins with cached entries or a pending lookup
+};
+
+/* Snapshot */
+static const char SNAPSHOT_MAGIC[8] = {'T', 'S', 'T', 'S', 'N', 'A', 'P', '\0'};
+static const uint32_t SNAPSHOT_VERSION = 3; // v2: log sequence number of the checkpoint, v3: subtree counts
+static const uint64_t SNAPSHOT_ALIGN = 64; // Pools start on cache-line boundaries
+
+enum {SNAP_TEMP_INTER, SNAP_TEMP_LEAF, SNAP_SPAT_INTER, SNAP_SPAT_LEAF, SNAP_DATA_CHUNK, SNAP_POOLS};
+
+struct Snapshot_Header { // On-disk header of TST::save (native byte order and struct layout)
+	char magic[8];
+	uint32_t version;
+	uint32_t slot_size[SNAP_POOLS]; // sizeof of each pool slot; guards against layout changes
+	int32_t temp_len, spat_len, s2_level, max_cell;
+	int32_t pivot_idx, data_inline_size, data_chunk_size, reserved;
+	uint64_t pool_size[SNAP_POOLS]; // # of slots (live + dead)
+	int32_t free_head[SNAP_POOLS];
+	int32_t dead[SNAP_POOLS]; // Dead counters (length of each free list)
+	uint64_t offset[SNAP_POOLS]; // File offset of each pool
+	uint64_t log_seq; // Last write-ahead log record contained in the snapshot
+};
+
+class Snapshot_Map { // Read-only mapping of a snapshot file
+public:
+	explicit Snapshot_Map(const std::string& path) : addr(MAP_FAILED), length(0) {
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) {
+			throw std::runtime_error("Cannot open snapshot file: " + path);
+		}
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(Snapshot_Header)) {
+			::close(fd);
+			throw std::runtime_error("Snapshot file is too short: " + path);
+		}
+		length = st.st_size;
+		addr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd);
+		if (addr == MAP_FAILED) {
+			throw std::runtime_error("Cannot map snapshot file: " + path);
+		}
+	}
+
+	~Snapshot_Map() {
+		if (addr != MAP_FAILED) munmap(addr, length);
+	}
+
+	Snapshot_Map(const Snapshot_Map&) = delete;
+	Snapshot_Map& operator=(const Snapshot_Map&) = delete;
+
+	const char* data() const { return static_cast<const char*>(addr); }
+	size_t size() const { return length; }
+
+private:
+	void* addr;
+	size_t length;
+};
+
+/* Write-Ahead Log */
+static const char LOG_MAGIC[8] = {'T', 'S', 'T', 'W', 'A', 'L', '\0', '\0'};
+static const uint32_t LOG_VERSION = 1;
+
+enum {LOG_INSERT = 1, LOG_DELETE, LOG_CLEAR}; // Logged operations
+enum {LOG_SYNC_NONE, LOG_SYNC_COMMIT, LOG_SYNC_INTERVAL}; // fsync policy
+
+struct Log_Options {
+	int sync_policy = LOG_SYNC_COMMIT; // NONE: leave flushing to the OS, COMMIT: fsync every group, INTERVAL: fsync every sync_interval_ms
+	int group_commit_ms = 2; // Longest time a record waits in the group buffer
+	int sync_interval_ms = 100;
+	size_t group_commit_bytes = 1 << 20; // Wake the flusher early once the buffer grows past this
+	std::string checkpoint_path; // Snapshot written by automatic checkpoints
+	size_t checkpoint_records = 0; // Checkpoint after this many logged operations (0: only via checkpoint())
+};
+
+template<class DATA>
+class Write_Ahead_Log { // Append-only log of Insert/Delete with group commit and checkpoints on background threads
+public:
+	// Record: [log seq 8][op 1][encoded time 4][encoded spatial 8][DATA][checksum 4]
+	static const size_t RECORD_SIZE = 8 + 1 + 4 + 8 + sizeof(DATA) + 4;
+	static const size_t HEADER_SIZE = 16; // [magic 8][version 4][sizeof(DATA) 4]
+
+	Write_Ahead_Log(const std::string& path, const Log_Options& opts)
+		: path(path), options(opts), appended(0), durable(0), force(false), stop(false), saving(false) {
+		static_assert(std::is_trivially_copyable<DATA>::value, "The write-ahead log requires a trivially copyable DATA type.");
+		fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+		if (fd < 0) {
+			throw std::runtime_error("Cannot open log file: " + path);
+		}
+		char header[HEADER_SIZE], existing[HEADER_SIZE];
+		make_header(header);
+
+		struct stat st;
+		if (fstat(fd, &st) != 0 || (st.st_size == 0 && !write_all(header, HEADER_SIZE))) {
+			::close(fd);
+			throw std::runtime_error("Cannot write log header: " + path);
+		}
+		if (st.st_size != 0 && (pread(fd, existing, HEADER_SIZE, 0) != (ssize_t)HEADER_SIZE ||
+			std::memcmp(header, existing, HEADER_SIZE) != 0)) { // Appending to an existing log
+			::close(fd);
+			throw std::runtime_error("Not a compatible TST log file: " + path);
+		}
+		last_sync = std::chrono::steady_clock::now();
+		worker = std::thread(&Write_Ahead_Log::flusher, this);
+	}
+
+	~Write_Ahead_Log() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stop = true;
+		}
+		wake.notify_one();
+		saver_wake.notify_one();
+		worker.join();
+		if (saver.joinable()) saver.join(); // Finishes a checkpoint in progress
+		fsync(fd);
+		::close(fd);
+	}
+
+	Write_Ahead_Log(const Write_Ahead_Log&) = delete;
+	Write_Ahead_Log& operator=(const Write_Ahead_Log&) = delete;
+
+	// Only copies the record into the group buffer; the flusher thread writes it out
+	void append(uint64_t seq, uint8_t op, unsigned int encoded_temp, unsigned long long encoded_spat, const DATA& data) {
+		char record[RECORD_SIZE];
+		std::memcpy(record, &seq, 8);
+		record[8] = op;
+		std::memcpy(record + 9, &encoded_temp, 4);
+		std::memcpy(record + 13, &encoded_spat, 8);
+		std::memcpy(record + 21, &data, sizeof(DATA));
+		uint32_t sum = checksum(record, RECORD_SIZE - 4);
+		std::memcpy(record + RECORD_SIZE - 4, &sum, 4);
+
+		bool wake_now;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			if (!error.empty()) throw std::runtime_error(error);
+			pending.insert(pending.end(), record, record + RECORD_SIZE);
+			appended++;
+			wake_now = pending.size() >= options.group_commit_bytes;
+		}
+		if (wake_now) wake.notify_one();
+	}
+
+	void flush() { // Block until every appended record is written and synced
+		std::unique_lock<std::mutex> guard(lock);
+		uint64_t target = appended;
+		force = true;
+		wake.notify_one();
+		done.wait(guard, [&]() { return durable >= target || !error.empty(); });
+		if (!error.empty()) throw std::runtime_error(error);
+	}
+
+	void discard_through(uint64_t seq) { // Drop the records up to seq (their effects are in a checkpoint)
+		// The records after seq are copied into a fresh file that replaces the log; the flusher waits meanwhile
+		std::lock_guard<std::mutex> file_guard(file_lock);
+		struct stat st;
+		if (fstat(fd, &st) != 0) throw std::runtime_error("Cannot read log file: " + path);
+		std::vector<char> kept(HEADER_SIZE), record(RECORD_SIZE);
+		make_header(kept.data());
+		for (off_t offset = HEADER_SIZE; offset + (off_t)RECORD_SIZE <= st.st_size; offset += RECORD_SIZE) {
+			if (pread(fd, record.data(), RECORD_SIZE, offset) != (ssize_t)RECORD_SIZE) {
+				throw std::runtime_error("Cannot read log file: " + path);
 			}
-			break;
+			uint64_t record_seq;
+			std::memcpy(&record_seq, record.data(), 8);
+			if (record_seq > seq) kept.insert(kept.end(), record.begin(), record.end());
 		}
-		u = spat_internal[u].child[bit];
+
+		std::string tmp_path = path + ".tmp";
+		int out = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		bool ok = out >= 0 && write_all(out, kept.data(), kept.size()) && fsync(out) == 0;
+		if (out >= 0) ::close(out);
+		int next = ok && std::rename(tmp_path.c_str(), path.c_str()) == 0 ? ::open(path.c_str(), O_RDWR | O_APPEND) : -1;
+		if (next < 0) {
+			std::remove(tmp_path.c_str());
+			throw std::runtime_error("Cannot rewrite log file: " + path);
+		}
+		::close(fd);
+		fd = next;
 	}
 
-	if(i != s2_level+1){
-		for(; i <= s2_level; i++){
-			bit = (encoded_spat >> (spat_len - 3 - 2*i)) & 0b11;
-			if(i != s2_level){
-				spat_internal[u].child[bit] = SPAT_INTER_IDX;
-				spat_internal.emplace_back(Node_S());
-				SPAT_INTER_IDX++;
-				u = spat_internal[u].child[bit];
+	// Hands a snapshot image (the index as of record seq) to the saver thread, which writes it to
+	// snapshot_path, syncs it and then drops the records up to seq
+	void checkpoint_async(const std::string& snapshot_path, std::vector<char>&& image, uint64_t seq) {
+		std::lock_guard<std::mutex> guard(lock);
+		if (!error.empty()) throw std::runtime_error(error);
+		job.reset(new Checkpoint_Job{snapshot_path, std::move(image), seq});
+		if (!saver.joinable()) saver = std::thread(&Write_Ahead_Log::save_checkpoints, this);
+		saver_wake.notify_one();
+	}
+
+	bool checkpoint_pending() {
+		std::lock_guard<std::mutex> guard(lock);
+		return job || saving;
+	}
+
+	void wait_checkpoint() { // Block until the saver thread is idle
+		std::unique_lock<std::mutex> guard(lock);
+		saved.wait(guard, [&]() { return !job && !saving; });
+		if (!error.empty()) throw std::runtime_error(error);
+	}
+
+	// Calls apply(seq, op, encoded time, encoded spatial, data) for every intact record
+	// and returns the length of the valid prefix (a torn tail is ignored)
+	template<class FN>
+	static size_t replay(const std::string& path, FN apply) {
+		std::ifstream in(path, std::ios::binary);
+		if (!in) return 0; // No log yet
+		std::vector<char> file((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		if (file.size() < HEADER_SIZE) return 0;
+
+		uint32_t version, data_size;
+		std::memcpy(&version, file.data() + 8, 4);
+		std::memcpy(&data_size, file.data() + 12, 4);
+		if (std::memcmp(file.data(), LOG_MAGIC, 8) != 0 || version != LOG_VERSION || data_size != sizeof(DATA)) {
+			throw std::runtime_error("Not a compatible TST log file: " + path);
+		}
+
+		size_t offset = HEADER_SIZE;
+		for (; offset + RECORD_SIZE <= file.size(); offset += RECORD_SIZE) {
+			const char* record = file.data() + offset;
+			uint32_t sum;
+			std::memcpy(&sum, record + RECORD_SIZE - 4, 4);
+			if (sum != checksum(record, RECORD_SIZE - 4)) break; // Torn or corrupted write
+
+			uint64_t seq;
+			unsigned int encoded_temp;
+			unsigned long long encoded_spat;
+			DATA data;
+			std::memcpy(&seq, record, 8);
+			std::memcpy(&encoded_temp, record + 9, 4);
+			std::memcpy(&encoded_spat, record + 13, 8);
+			std::memcpy(&data, record + 21, sizeof(DATA));
+			apply(seq, (int)(uint8_t)record[8], encoded_temp, encoded_spat, data);
+		}
+		return offset;
+	}
+
+private:
+	static uint32_t checksum(const char* bytes, size_t n) { // FNV-1a
+		uint32_t h = 2166136261u;
+		for (size_t i = 0; i < n; i++) {
+			h ^= (uint8_t)bytes[i];
+			h *= 16777619u;
+		}
+		return h;
+	}
+
+	static void make_header(char* header) { // [magic 8][version 4][sizeof(DATA) 4]
+		uint32_t data_size = sizeof(DATA);
+		std::memcpy(header, LOG_MAGIC, 8);
+		std::memcpy(header + 8, &LOG_VERSION, 4);
+		std::memcpy(header + 12, &data_size, 4);
+	}
+
+	bool write_all(const char* bytes, size_t n) {
+		return write_all(fd, bytes, n);
+	}
+
+	static bool write_all(int out, const char* bytes, size_t n) {
+		while (n > 0) {
+			ssize_t written = ::write(out, bytes, n);
+			if (written < 0) {
+				if (errno == EINTR) continue;
+				return false;
 			}
-			else{ // Leaf Node
-				spat_internal[u].child[bit] = SPAT_LEAF_IDX;
-				spat_leaf.emplace_back(Data_Node<DATA>());
-				SPAT_LEAF_IDX++;
-				u = spat_internal[u].child[bit];
+			bytes += written;
+			n -= written;
+		}
+		return true;
+	}
+
+	void flusher() {
+		std::vector<char> writing;
+		std::unique_lock<std::mutex> guard(lock);
+		while (true) {
+			wake.wait_for(guard, std::chrono::milliseconds(options.group_commit_ms), [&]() {
+				return stop || force || pending.size() >= options.group_commit_bytes;
+			});
+
+			// Take the whole group and write it outside the lock
+			writing.swap(pending);
+			uint64_t group_end = appended;
+			bool forced = force || stop;
+			bool exiting = stop;
+			force = false;
+			guard.unlock();
+
+			std::unique_lock<std::mutex> file_guard(file_lock);
+			bool ok = writing.empty() || write_all(writing.data(), writing.size());
+			if (!writing.empty()) unsynced = true;
+			bool sync_now = forced || options.sync_policy == LOG_SYNC_COMMIT ||
+				(options.sync_policy == LOG_SYNC_INTERVAL &&
+				 std::chrono::steady_clock::now() - last_sync >= std::chrono::milliseconds(options.sync_interval_ms));
+			if (ok && unsynced && sync_now) {
+				ok = (fdatasync(fd) == 0);
+				unsynced = false;
+				last_sync = std::chrono::steady_clock::now();
 			}
+			file_guard.unlock();
+			writing.clear();
+
+			guard.lock();
+			if (!ok) error = "Failed to write the log file.";
+			durable = group_end;
+			done.notify_all();
+			if (exiting && pending.empty()) break;
 		}
-		spat_leaf[u].ENCODED_TIME = encoded_temp;
-		spat_leaf[u].S2_ID = encoded_spat;
+	}
 
-		// 6 - Update the node into the doubly linked list based on TSC_ID
-		switch (spat_leaf.size() - D_SPAT_LEAF) {
-			case 1:
-				break;
-			case 2: {
-				int FIRST_IDX = 0;
-				if (spat_leaf[FIRST_IDX] < spat_leaf[u]) {
-					spat_leaf[FIRST_IDX].next = u;
-					spat_leaf[u].prev = FIRST_IDX;
-				} else {
-					spat_leaf[FIRST_IDX].prev = u;
-					spat_leaf[u].next = FIRST_IDX;
-				}
-				break;
+	void save_checkpoints() { // Saver thread
+		std::unique_lock<std::mutex> guard(lock);
+		while (true) {
+			saver_wake.wait(guard, [&]() { return stop || job; });
+			if (!job) break; // Stopping, with nothing left to save
+			std::unique_ptr<Checkpoint_Job> current = std::move(job);
+			saving = true;
+			guard.unlock();
+
+			std::string failure;
+			try {
+				write_snapshot(current->path, current->image);
+				discard_through(current->seq);
+			} catch (const std::exception& e) {
+				failure = e.what();
 			}
-			default: { // More than 2 nodes
-				int PREV_IDX = POINTER_NULL_INT;
-				int NEXT_IDX = POINTER_NULL_INT;
-				int PIVOT = SPAT_LEAF_IDX - 2;
-				unsigned v = u;
 
-				if(LAST_ITER >= 2){					
-					if(LAST_BIT == CHILD_ZERO){
-						unsigned left_most_idx = LAST_IDX;
-						if(spat_internal[left_most_idx].child[CHILD_ONE] != POINTER_NULL_INT)
-							left_most_idx = spat_internal[left_most_idx].child[CHILD_ONE];
-						else if(spat_internal[left_most_idx].child[CHILD_TWO] != POINTER_NULL_INT)
-							left_most_idx = spat_internal[left_most_idx].child[CHILD_TWO];
-						else
-							left_most_idx = spat_internal[left_most_idx].child[CHILD_THIRD];
+			guard.lock();
+			if (!failure.empty() && error.empty()) error = failure;
+			saving = false;
+			saved.notify_all();
+		}
+	}
 
-						// Check the Left-most node's idx on sub-trie
+	static void write_snapshot(const std::string& snapshot_path, const std::vector<char>& image) {
+		// Same steps as TST::save followed by the sync in TST::checkpoint: a complete file replaces the old one
+		std::string tmp_path = snapshot_path + ".tmp";
+		int out = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		bool ok = out >= 0 && write_all(out, image.data(), image.size()) && fsync(out) == 0;
+		if (out >= 0) ::close(out);
+		if (!ok || std::rename(tmp_path.c_str(), snapshot_path.c_str()) != 0) {
+			std::remove(tmp_path.c_str());
+			throw std::runtime_error("Failed to write snapshot file: " + snapshot_path);
+		}
+	}
+
+	struct Checkpoint_Job {
+		std::string path;
+		std::vector<char> image;
+		uint64_t seq;
+	};
+
+	int fd;
+	std::string path;
+	Log_Options options;
+	std::mutex lock;
+	std::mutex file_lock; // Held while fd is written or replaced
+	std::condition_variable wake, done;
+	std::vector<char> pending; // Group buffer
+	uint64_t appended, durable; // # of records handed in / written out
+	bool force, stop;
+	bool unsynced = false; // Written but not yet fsync'ed (flusher thread only)
+	std::string error;
+	std::chrono::steady_clock::time_point last_sync;
+	std::thread worker;
+
+	std::condition_variable saver_wake, saved;
+	std::unique_ptr<Checkpoint_Job> job; // At most one image waits for the saver
+	bool saving;
+	std::thread saver; // Started by the first checkpoint_async
+};
+
+/* Tree Definition */
+enum Time_Res {TIME_RUNTIME = 0, TIME_YEAR = 6, TIME_MONTH = 10, TIME_DAY = 15, // Encoded temporal bit length
+				TIME_HOUR = 20, TIME_MINUTE = 26, TIME_SECOND = 32};
+
+template<int FIXED>
+struct Fixed_Len { // A bit length that is a compile-time constant when FIXED > 0, so loops over it unroll
+	int value;
+	Fixed_Len(int v = FIXED) : value(v) {}
+	operator int() const { return FIXED > 0 ? FIXED : value; }
+};
+
+template<class DATA, int T_RES = TIME_RUNTIME, int S2_RES = 0> // Resolutions fixed at compile time, or 0 to pick them at run time
+class TST {
+private:
+	static const int REF_YEAR = 2000;
+	static constexpr int ROOT_IDX = 0;
+	int MAXCELL = 10000;
+
+	Fixed_Len<T_RES> temp_len;
+	Fixed_Len<S2_RES ? 2 * S2_RES + 4 : 0> spat_len;
+	Fixed_Len<T_RES && S2_RES ? T_RES + 2 * S2_RES + 4 : 0> total_len;
+	Fixed_Len<S2_RES> s2_level; // selected S2 level
+	int PIVOT_IDX; // Most recently linked spatial leaf (entry of the linked-list search)
+	
+	static constexpr int time_fields(int len) { // # of time_encoder arguments at a temporal bit length
+		return len == TIME_YEAR ? 1 : len == TIME_MONTH ? 2 : len == TIME_DAY ? 3 :
+				len == TIME_HOUR ? 4 : len == TIME_MINUTE ? 5 : len == TIME_SECOND ? 6 : 0;
+	}
+
+	enum{LEFT_CHILD, RIGHT_CHILD}; // temporal child index
+	enum{CHILD_ZERO, CHILD_ONE, CHILD_TWO, CHILD_THIRD, // spatial child index
+		  CHILD_FOURTH, CHILD_FIFTH, CHILD_SIXTH, CHILD_SEVENTH};
+
+	Node_Pool<Node_T> temp_internal;
+	Node_Pool<Linked_Node> temp_leaf;
+	Node_Pool<Node_S> spat_internal;
+	Node_Pool<Data_Node<DATA>> spat_leaf;
+	Data_Arena<DATA> data_arena; // Owns the overflow payload of spatial leaves
+	std::unique_ptr<Snapshot_Map> snapshot_map; // Set while the pools are served from a mapped snapshot
+	std::unique_ptr<Write_Ahead_Log<DATA>> wal; // Set while Insert/Delete are logged
+	std::unique_ptr<Query_Cache<DATA>> query_cache; // Set while range_search results are cached
+	std::unique_ptr<Reader_Epochs> epochs{new Reader_Epochs()}; // Readers running concurrently with the writer
+	Log_Options log_options;
+	uint64_t LOG_SEQ = 0; // Sequence number of the last logged operation
+	size_t LOG_SINCE_CHECKPOINT = 0;
+
+	int insert_temp(unsigned int, int*, int);
+	int insert_spat(unsigned int, unsigned long long, int, int*, int);
+	void shared_prefix(const std::tuple<unsigned int, unsigned long long, DATA>&,
+						const std::tuple<unsigned int, unsigned long long, DATA>&, int&, int&) const;
+	static bool key_order(const std::tuple<unsigned int, unsigned long long, DATA>&,
+						const std::tuple<unsigned int, unsigned long long, DATA>&);
+	int trav_temp(unsigned int);
+	bool remove_data(unsigned int, unsigned long long, const DATA&);
+	void reset();
+	void attach_snapshot(const char*, size_t, bool);
+	Snapshot_Header snapshot_header() const; // Header and pool offsets of a snapshot of the current index
+	template<class WRITE>
+	void write_snapshot(const Snapshot_Header&, WRITE) const;
+	std::vector<char> snapshot_image() const; // A snapshot in memory, for checkpoints saved in the background
+	void check_writable() const;
+	void check_plan(const Spatial_Plan&) const;
+	void log_op(int, unsigned int, unsigned long long, const DATA&);
+	void log_commit();
+	void retire();
+	int relocate_spat(int, Node_Pool<Node_S>&, Node_Pool<Data_Node<DATA>>&,
+						std::vector<std::pair<int, int>>&, std::vector<int>&);
+	void trav_spat(const Spatial_Plan&, int, std::vector<DATA>&);
+	template<class ON_CELL, class ON_LEAF>
+	bool trav_plan(const Spatial_Plan&, int, ON_CELL, ON_LEAF); // false once on_leaf asked to stop
+	template<class ON_LEAF>
+	bool trav_cell(int, int, unsigned long long, ON_LEAF); // Leaves of one cell, from its internal node
+	double plan_cell(const S2Region&, S2CellId, const std::vector<int>&, int&, std::vector<std::pair<S2CellId, bool>>&);
+	template<class INSIDE>
+	void refine_search(const Spatial_Plan&, unsigned int, unsigned int, std::vector<DATA>&, INSIDE);
+	void add_count(int, const int*, int); // Subtree counts along an insert/delete path (and cache invalidation)
+
+public:
+	typedef std::tuple<unsigned int, unsigned long long, DATA> Record; // (encoded time, encoded spatial, data)
+	typedef std::tuple<const Spatial_Plan*, unsigned int, unsigned int> Query; // (plan, encoded start, encoded end)
+
+	TST(); 
+	TST(int, const std::string&);
+	template<class ITER>
+	TST(int, const std::string&, ITER, ITER); // Bulk-load constructor
+	
+	template<typename... Args>
+	unsigned int time_encoder(Args...);
+	unsigned long long space_encoder(double, double);
+	void time_encoder_batch(size_t, const int* const*, unsigned int*); // One array per field, year first; same codes as time_encoder
+	void space_encoder_batch(size_t, const double*, const double*, unsigned long long*); // Lat/lng arrays; same codes as space_encoder
+	void Insert(unsigned int, unsigned long long, DATA);
+	void Delete(unsigned int, unsigned long long, DATA);
+	void InsertBatch(std::vector<Record>&); // Sorts the batch by key, then inserts with shared path reuse
+	template<class ITER>
+	void bulk_load(ITER, ITER); // Build from (encoded time, encoded spatial, DATA) tuples
+
+	Spatial_Plan REC_S2_FINDER(std::vector<double>&, std::vector<double>&); // Covering of a rectangle, compiled for this index
+	Spatial_Plan REGION_S2_FINDER(const S2Region&); // Any S2 region: polygon, cap, cell union, ...
+	Spatial_Plan POLYLINE_S2_FINDER(const S2Polyline&, S1Angle); // Points within a distance of a polyline
+	Spatial_Plan ADAPTIVE_S2_FINDER(const S2Region&, unsigned int, unsigned int); // Covering fitted to the data in a time window
+	Spatial_Plan compile_plan(const std::map<int, std::vector<unsigned long long>>&) const; // S2 cell ids grouped by level
+	void range_search(const Spatial_Plan&, unsigned int, unsigned int, std::vector<DATA>& res);
+	void range_search(const std::map<int, std::vector<unsigned long long>>&, 
+									unsigned int, unsigned int, std::vector<DATA>& res);
+	void parallel_range_search(const Spatial_Plan&, // Time bins on n threads (0: all cores)
+									unsigned int, unsigned int, std::vector<DATA>& res, int = 0);
+	void range_search_batch(const Plan_Batch&, const std::vector<std::pair<unsigned int, unsigned int>>&, // One pass for
+							std::vector<std::vector<DATA>>& res); // many plans, each with its own time window
+	void range_search_batch(const std::vector<Query>&, std::vector<std::vector<DATA>>& res);
+	size_t range_count(const Spatial_Plan&, unsigned int, unsigned int); // # of values, without reading them
+	size_t range_count(unsigned int, unsigned int); // # of values in a time window, anywhere
+	bool next_bin(unsigned int, unsigned int&); // First time bin at or after a time; false if there is none
+	template<class FN>
+	void range_aggregate(const Spatial_Plan&, unsigned int, unsigned int, FN); // fn(const DATA&) on every value
+	template<class FN>
+	bool range_visit(const Spatial_Plan&, unsigned int, unsigned int, FN); // Streams fn(const DATA&) -> bool
+	template<class FN>
+	bool range_visit_spans(const Spatial_Plan&, unsigned int, unsigned int, FN); // fn(const DATA*, size_t) -> bool, zero-copy
+	void range_search(const Spatial_Plan&, unsigned int, unsigned int, std::vector<DATA>& res, size_t limit);
+	void range_search(const Spatial_Plan&, unsigned int, unsigned int, // Split by interior / boundary cells
+						std::vector<DATA>& interior, std::vector<DATA>& boundary);
+	template<class D = DATA> // Exact: DATA = Located<...>
+	void range_search(const Spatial_Plan&, const S2LatLngRect&, unsigned int, unsigned int, std::vector<D>& res);
+	template<class D = DATA>
+	void range_search(const Spatial_Plan&, const S2Region&, unsigned int, unsigned int, std::vector<D>& res);
+	void knn_search(double, double, size_t, unsigned int, unsigned int, // k nearest values to (lat, lng), nearest first
+					std::vector<std::pair<DATA, S1Angle>>& res);
+
+	void clear(); // Drop every node and release all payload storage
+	void set_pool_reserve(size_t); // Address space each node pool reserves (default 4 GiB); only on an empty index
+	void compact(); // Rebuild every pool with live nodes only, in depth-first order
+	void compact(unsigned int); // Relocate one time bin's spatial subtrie into a contiguous run
+
+	void save(const std::string&) const; // Write a binary snapshot of the index
+	void load_snapshot(const std::string&); // Read a snapshot into owned (writable) storage
+	void open_snapshot(const std::string&); // Map a snapshot read-only and query it in place
+	bool is_read_only() const; // True while serving a mapped snapshot
+
+	void enable_log(const std::string&, const Log_Options& = Log_Options()); // Log every Insert/Delete
+	void disable_log(); // Flush and close the log
+	void flush_log(); // Block until every logged operation is durable
+	void checkpoint(const std::string&); // Save a snapshot, then truncate the log
+	void recover(const std::string&, const std::string&); // Latest snapshot + log replay
+
+	void enable_cache(size_t); // Cache range_search results per time bin, up to this many values
+	void disable_cache();
+	size_t getCache_Hits() const; // Getter for # of time bins answered from the cache
+	size_t getCache_Misses() const; // Getter for # of time bins traversed with the cache enabled
+
+	void setMaxCells(int); // Setter for max # of S2 cells
+	int getInter_NodeCount() const; // Getter for # of Internal Nodes
+	int getLeaf_NodeCount() const; // Getter for # of Leaf Nodes
+	int getTotal_NodeCount() const; // Getter for # of Tree Nodes
+	int getTemp_len() const; // Getter for Encoded Temporal Bit length
+	int getSpat_len() const; // Getter for Encoded Spatial Bit length
+	int getTotal_len() const; // Getter for Encoded Total Bit length
+	int get_DataCount() const; // Getter for Total Data Count
+	double get_size() const; // Getter for Index size
+	double get_payload_size() const; // Getter for Data Arena size
+};
+
+
+template<class DATA, int T_RES, int S2_RES> // Minimum S2 Level is 1 and Time resolution is year, unless fixed at compile time
+TST<DATA, T_RES, S2_RES>::TST() : temp_len(T_RES ? T_RES : 6), spat_len(S2_RES ? 2 * S2_RES + 4 : 6),
+	total_len(temp_len + spat_len), s2_level(S2_RES ? S2_RES : 1), PIVOT_IDX(POINTER_NULL_INT) {
+	reset();
+}
+
+template<class DATA, int T_RES, int S2_RES>
+TST<DATA, T_RES, S2_RES>::TST(int s2_res, const std::string& t_res){
+	if (s2_res < 1 || s2_res > 30) {
+        throw std::invalid_argument("Invalid spatial resolution (first argument). Must be between 1 and 30.");
+    }
+	
+	s2_level = s2_res;
+    spat_len = s2_level * 2 + 4;
+
+    // Validate and assign temporal resolution using switch-like logic
+    if (t_res == "year") {
+        temp_len = 6;
+    } else if (t_res == "month") {
+        temp_len = 10;
+    } else if (t_res == "day") {
+        temp_len = 15;
+    } else if (t_res == "hour") {
+        temp_len = 20;
+    } else if (t_res == "minute") {
+        temp_len = 26;
+    } else if (t_res == "second") {
+        temp_len = 32;
+    } else {
+        throw std::invalid_argument("Invalid temporal resolution (second argument). Must be one of: year, month, day, hour, minute, second.");
+    }
+	if((S2_RES && s2_level.value != S2_RES) || (T_RES && temp_len.value != T_RES)){
+		throw std::invalid_argument("Resolution does not match the one this TST is compiled for.");
+	}
+	total_len = temp_len + spat_len;
+
+	reset();
+}
+
+template<class DATA, int T_RES, int S2_RES>
+template<class ITER>
+TST<DATA, T_RES, S2_RES>::TST(int s2_res, const std::string& t_res, ITER first, ITER last) : TST(s2_res, t_res) {
+	bulk_load(first, last);
+}
+
+template<class DATA, int T_RES, int S2_RES>
+template<typename... Args>
+unsigned int TST<DATA, T_RES, S2_RES>::time_encoder(Args... args) {
+	static_assert(T_RES == TIME_RUNTIME || sizeof...(Args) == time_fields(T_RES),
+				"time_encoder takes one argument per temporal field of the compiled resolution.");
+    int expected_args = 0;
+    const std::string arg_list[] = {"year", "month", "day", "hour", "minute", "second"};
+	const int bit_lengths[] = {6, 4, 5, 5, 6, 6};
+
+    switch (temp_len) {
+        case 6:  expected_args = 1; break; // year
+        case 10: expected_args = 2; break; // year, month
+        case 15: expected_args = 3; break; // year, month, day
+        case 20: expected_args = 4; break; // year, month, day, hour
+        case 26: expected_args = 5; break; // year, month, day, hour, minute
+        case 32: expected_args = 6; break; // year, month, day, hour, minute, second
+        default:
+            throw std::invalid_argument("Invalid temporal resolution. Cannot determine required arguments.");
+    }
+
+    // Validate the number of temporal arguments
+    if (sizeof...(args) != expected_args) {
+		std::string required_args;
+        for (int i = 0; i < expected_args; ++i) {
+            if (!required_args.empty()) {
+                required_args += ", ";
+            }
+            required_args += arg_list[i];
+        }
+
+        throw std::invalid_argument(
+            "Expected " + std::to_string(expected_args + 2) + " arguments (longitude, latitude, " + 
+            required_args + "), but got " + std::to_string(sizeof...(args) + 2) + "."
+        );
+    }
+
+	/* Temporal Encoding */
+	unsigned int encoded_temporal = 0;
+	int acc_length = 0;
+    int idx = 0;
+
+	([&](const auto& arg) {
+        uint8_t bit_length = bit_lengths[idx];
+        uint8_t value = static_cast<uint8_t>(arg);
+		if(idx == 0) value = value - REF_YEAR; //  the reference year is subtracted
+		acc_length += bit_length;
+
+		// Convert value to binary string and keep only the required bits (temp_len bits)
+		encoded_temporal += (value << (temp_len - acc_length));
+        ++idx;
+    }(args), ...);
+
+	/* Return Encoded Temporal Information */
+    return encoded_temporal;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+unsigned long long TST<DATA, T_RES, S2_RES>::space_encoder(double lat, double lng) {
+	/* Spatial Encoding: S2Geometry */
+	S2LatLng latlng = S2LatLng::FromDegrees(lat, lng);
+	S2CellId cell_id = S2CellId(latlng);
+	S2CellId selected_cell_id = cell_id.parent(s2_level);
+
+	// Convert value to binary string and keep only the required bits (spat_len bits)
+	unsigned long long encoded_spatial = selected_cell_id.id() >> (64 - spat_len);
+	
+	return encoded_spatial;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+void TST<DATA, T_RES, S2_RES>::time_encoder_batch(size_t n, const int* const* fields, unsigned int* out) {
+	const int bit_lengths[] = {6, 4, 5, 5, 6, 6};
+	int expected_fields = 0;
+	for(int acc = 0; acc < temp_len && expected_fields < 6; expected_fields++) acc += bit_lengths[expected_fields];
+	for(int f = 0; f < expected_fields; f++){
+		if(fields[f] == nullptr){
+			throw std::invalid_argument("time_encoder_batch needs " + std::to_string(expected_fields) +
+										" field arrays at this temporal resolution, but field " + std::to_string(f) + " is null.");
+		}
+	}
+
+	// Field by field, so each pass is a plain loop over one array that the compiler vectorizes
+	std::fill(out, out + n, 0u);
+	int acc_length = 0;
+	for(int f = 0; f < expected_fields; f++){
+		acc_length += bit_lengths[f];
+		const int* field = fields[f];
+		const unsigned int shift = temp_len - acc_length;
+		const uint8_t ref = (f == 0) ? (uint8_t)REF_YEAR : 0;
+		for(size_t k = 0; k < n; k++){
+			uint8_t value = (uint8_t)((uint8_t)field[k] - ref); // Wraps exactly like time_encoder
+			out[k] += (unsigned int)value << shift;
+		}
+	}
+}
+
+template<class DATA, int T_RES, int S2_RES>
+void TST<DATA, T_RES, S2_RES>::space_encoder_batch(size_t n, const double* lat, const double* lng, unsigned long long* out) {
+	// The same steps as S2CellId(S2LatLng), in passes over a block: trigonometry through S2 itself, then face,
+	// (u, v), (s, t) and (i, j) without branches, then only the Hilbert digits down to s2_level
+	const size_t BLOCK = 256;
+	const double MAX_SIZE = 1 << 30;
+	const uint16_t* lookup = hilbert_lookup();
+	const int last_step = (60 - 2 * s2_level) / 8; // Lowest 8-bit step of the position that reaches s2_level
+	double x[BLOCK], y[BLOCK], z[BLOCK];
+	int face[BLOCK], ci[BLOCK], cj[BLOCK];
+
+	for(size_t base = 0; base < n; base += BLOCK){
+		size_t m = std::min(BLOCK, n - base);
+		for(size_t k = 0; k < m; k++){
+			S2Point p = S2LatLng::FromDegrees(lat[base + k], lng[base + k]).ToPoint();
+			x[k] = p[0]; y[k] = p[1]; z[k] = p[2];
+		}
+
+		for(size_t k = 0; k < m; k++){
+			double ax = std::fabs(x[k]), ay = std::fabs(y[k]), az = std::fabs(z[k]);
+			int axis = (ax > ay) ? ((ax > az) ? 0 : 2) : ((ay > az) ? 1 : 2);
+			double pa = (axis == 0) ? x[k] : (axis == 1) ? y[k] : z[k];
+			int f = axis + ((pa < 0) ? 3 : 0);
+
+			// Face projection (u, v) = (nu / pa, nv / pa), with the numerators S2 uses on each face
+			double nu = (f == 0) ? y[k] : (f == 1) ? -x[k] : (f == 2) ? -x[k] : (f == 3) ? z[k] : (f == 4) ? z[k] : -y[k];
+			double nv = (f == 0) ? z[k] : (f == 1) ? z[k] : (f == 2) ? -y[k] : (f == 3) ? y[k] : (f == 4) ? -x[k] : -x[k];
+			double u = nu / pa, v = nv / pa;
+
+			// Quadratic UV -> ST projection, then the leaf cell coordinates
+			double ru = 0.5 * std::sqrt(1 + 3 * std::fabs(u)), rv = 0.5 * std::sqrt(1 + 3 * std::fabs(v));
+			double s = (u >= 0) ? ru : 1 - ru, t = (v >= 0) ? rv : 1 - rv;
+			double i = std::nearbyint(MAX_SIZE * s - 0.5), j = std::nearbyint(MAX_SIZE * t - 0.5);
+			face[k] = f;
+			ci[k] = (int)std::max(0.0, std::min(MAX_SIZE - 1, i));
+			cj[k] = (int)std::max(0.0, std::min(MAX_SIZE - 1, j));
+		}
+
+		for(size_t k = 0; k < m; k++){
+			unsigned long long pos = (unsigned long long)face[k] << 60;
+			int bits = face[k] & 1; // Swap orientation on odd faces
+			for(int step = 7; step >= last_step; step--){
+				bits += ((ci[k] >> (step * 4)) & 15) << 6;
+				bits += ((cj[k] >> (step * 4)) & 15) << 2;
+				bits = lookup[bits];
+				pos |= (unsigned long long)(bits >> 2) << (step * 8);
+				bits &= 3;
+			}
+			out[base + k] = ((pos << 1) >> (64 - spat_len)) | 1; // Digits below s2_level are dropped, the trailing 1 is set
+		}
+	}
+}
+
+template<class DATA, int T_RES, int S2_RES>
+void TST<DATA, T_RES, S2_RES>::Insert(unsigned int encoded_temp, unsigned long long encoded_spat, DATA data) {
+	check_writable();
+	if(wal) log_op(LOG_INSERT, encoded_temp, encoded_spat, data);
+	int temp_path[33], spat_path[31]; // Node index at each depth / level
+	temp_path[0] = ROOT_IDX;
+
+	int TIME_IDX = insert_temp(encoded_temp, temp_path, 0);
+	int LEAF_IDX = insert_spat(encoded_temp, encoded_spat, TIME_IDX, spat_path, -1);
+
+	// Data Pointing (Insert into data vector)
+	spat_leaf[LEAF_IDX].insert_data(data, data_arena);
+	add_count(TIME_IDX, spat_path, 1);
+
+	if(wal) log_commit();
+	return;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+int TST<DATA, T_RES, S2_RES>::insert_temp(unsigned int encoded_temp, int* temp_path, int depth) {
+	// temp_path[0..depth] holds an existing prefix of the path; the rest is found or created.
+	/* Temporal Node Insertion */
+	int i, LAST_ITER, LAST_BIT, bit = 0;
+	unsigned LAST_IDX, u = temp_path[depth];
+
+	// 1 - Search for the existence of a path in the trie with a time prefix.
+	for(i = depth + 1; i <= temp_len; i++){
+		bit = (encoded_temp >> (temp_len - i)) & 1;
+		if(temp_internal[u].child[bit] == POINTER_NULL_INT){
+			LAST_ITER = i;
+			LAST_BIT = bit;
+			LAST_IDX = u;
+			break;
+		}
+		u = temp_internal[u].child[bit];
+		temp_path[i] = u;
+	}
+
+	// 2 - add path to time prefix
+	if(i != temp_len+1){
+		// The new branch stays private until step 4, so readers never reach a half-built path
+		int ATTACH_IDX = u, ATTACH_BIT = bit, BRANCH_IDX = POINTER_NULL_INT;
+		for(; i <= temp_len; i++){
+			bit = (encoded_temp >> (temp_len - i)) & 1;
+			int NEW_IDX = (i != temp_len) ? temp_internal.allocate() : temp_leaf.allocate();
+			if(BRANCH_IDX == POINTER_NULL_INT) BRANCH_IDX = NEW_IDX;
+			else temp_internal[u].child[bit] = NEW_IDX;
+			u = NEW_IDX;
+			temp_path[i] = u;
+		}
+
+		temp_leaf[u].ENCODED_TIME = encoded_temp;
+
+		// 3 - Update the node into the doubly linked list based on ENCODED_TIME
+		switch (temp_leaf.live()) {
+			case 1:
+				break;
+			default: { // More than 1 node: the sibling subtree of LAST_IDX holds the neighbour
+				int PREV_IDX = POINTER_NULL_INT;
+				int NEXT_IDX = POINTER_NULL_INT;
+				unsigned v = u;
+
+				if(LAST_BIT == 0){
+					unsigned left_most_idx = temp_internal[LAST_IDX].child[1];
+					for(int j = LAST_ITER + 1; j <= temp_len; j++){
+						if(temp_internal[left_most_idx].child[0] != POINTER_NULL_INT)
+							left_most_idx = temp_internal[left_most_idx].child[0];
+						else
+							left_most_idx = temp_internal[left_most_idx].child[1];
+					}
+					NEXT_IDX = left_most_idx;
+					PREV_IDX = temp_leaf[NEXT_IDX].prev;
+				}
+				else{
+					unsigned right_most_idx = temp_internal[LAST_IDX].child[0];
+					for(int j = LAST_ITER + 1; j <= temp_len; j++){
+						if(temp_internal[right_most_idx].child[1] != POINTER_NULL_INT)
+							right_most_idx = temp_internal[right_most_idx].child[1];
+						else
+							right_most_idx = temp_internal[right_most_idx].child[0];
+					}
+					PREV_IDX = right_most_idx;
+					NEXT_IDX = temp_leaf[PREV_IDX].next;
+				}
+
+				temp_leaf[v].prev = PREV_IDX;
+				temp_leaf[v].next = NEXT_IDX;
+
+				// Update prev node
+				if(PREV_IDX != POINTER_NULL_INT){
+					publish_link(temp_leaf[PREV_IDX].next, v);
+				}
+
+				// Update next node
+				if(NEXT_IDX != POINTER_NULL_INT){
+					publish_link(temp_leaf[NEXT_IDX].prev, v);
+				}
+				break;
+			}
+		}
+
+		// 4 - Publish the branch
+		publish_link(temp_internal[ATTACH_IDX].child[ATTACH_BIT], BRANCH_IDX);
+	}
+	return u;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+int TST<DATA, T_RES, S2_RES>::insert_spat(unsigned int encoded_temp, unsigned long long encoded_spat, int TIME_IDX, int* spat_path, int level) {
+	// spat_path[0..level] holds an existing prefix of the spatial path (level -1: none).
+	/* Spatial Node Insertion */
+
+	// 4 - Search for the existence of a path in the trie with a space suffix.
+	int i, LAST_ITER = -1, LAST_BIT = 0, bit = 0;
+	unsigned LAST_IDX = 0, u;
+
+	// The first new node and the link that will point at it; the new branch stays
+	// private until the leaf is in the linked list (step 7)
+	int* ATTACH_LINK = nullptr;
+	int BRANCH_IDX = POINTER_NULL_INT;
+
+	// 4-1 - Check the leading 3 bits.
+	if(level < 0){
+		int lead_3bits = (encoded_spat >> (spat_len - 3)) & 0b111;
+		if(temp_leaf[TIME_IDX].child[lead_3bits] == POINTER_NULL_INT) {
+			BRANCH_IDX = spat_internal.allocate();
+			ATTACH_LINK = &temp_leaf[TIME_IDX].child[lead_3bits];
+			spat_path[0] = BRANCH_IDX;
+		}
+		else{
+			spat_path[0] = temp_leaf[TIME_IDX].child[lead_3bits];
+		}
+		level = 0;
+	}
+	u = spat_path[level];
+
+	// 4-2 - Check in 2-bit increments
+	for(i = level + 1; i <= s2_level; i++){
+		bit = (encoded_spat >> (spat_len - 3 - 2*i)) & 0b11;
+		if(spat_internal[u].child[bit] == POINTER_NULL_INT){
+			if(i >= 2){
+				LAST_ITER = i;
+				LAST_BIT = bit;
+				LAST_IDX = u;
+			}
+			break;
+		}
+		u = spat_internal[u].child[bit];
+		spat_path[i] = u;
+	}
+
+	if(i != s2_level+1){
+		for(; i <= s2_level; i++){
+			bit = (encoded_spat >> (spat_len - 3 - 2*i)) & 0b11;
+			int NEW_IDX = (i != s2_level) ? spat_internal.allocate() : spat_leaf.allocate(); // Leaf Node at s2_level
+			if(ATTACH_LINK == nullptr){
+				ATTACH_LINK = &spat_internal[u].child[bit];
+				BRANCH_IDX = NEW_IDX;
+			}
+			else{
+				spat_internal[u].child[bit] = NEW_IDX;
+			}
+			u = NEW_IDX;
+			spat_path[i] = u;
+		}
+		spat_leaf[u].ENCODED_TIME = encoded_temp;
+		spat_leaf[u].S2_ID = encoded_spat;
+
+		// 6 - Update the node into the doubly linked list based on TSC_ID
+		switch (spat_leaf.live()) {
+			case 1:
+				break;
+			case 2: {
+				int FIRST_IDX = PIVOT_IDX; // The only other live leaf
+				if (spat_leaf[FIRST_IDX] < spat_leaf[u]) {
+					spat_leaf[u].prev = FIRST_IDX;
+					publish_link(spat_leaf[FIRST_IDX].next, u);
+				} else {
+					spat_leaf[u].next = FIRST_IDX;
+					publish_link(spat_leaf[FIRST_IDX].prev, u);
+				}
+				break;
+			}
+			default: { // More than 2 nodes
+				int PREV_IDX = POINTER_NULL_INT;
+				int NEXT_IDX = POINTER_NULL_INT;
+				int PIVOT = PIVOT_IDX;
+				unsigned v = u;
+
+				if(LAST_ITER >= 2){					
+					if(LAST_BIT == CHILD_ZERO){
+						unsigned left_most_idx = LAST_IDX;
+						if(spat_internal[left_most_idx].child[CHILD_ONE] != POINTER_NULL_INT)
+							left_most_idx = spat_internal[left_most_idx].child[CHILD_ONE];
+						else if(spat_internal[left_most_idx].child[CHILD_TWO] != POINTER_NULL_INT)
+							left_most_idx = spat_internal[left_most_idx].child[CHILD_TWO];
+						else
+							left_most_idx = spat_internal[left_most_idx].child[CHILD_THIRD];
+
+						// Check the Left-most node's idx on sub-trie
 						for(int j = LAST_ITER + 1; j <= s2_level; j++){
 							if(spat_internal[left_most_idx].child[CHILD_ZERO] != POINTER_NULL_INT)
 								left_most_idx = spat_internal[left_most_idx].child[CHILD_ZERO];
@@ -467,483 +2043,2408 @@ void TST<DATA>::Insert(unsigned int encoded_temp, unsigned long long encoded_spa
 						else
 							right_most_idx = spat_internal[right_most_idx].child[CHILD_ZERO];
 
-						// Check the right-most node's idx on sub-trie
-						for(int j = LAST_ITER + 1; j <= s2_level; j++){
-							if(spat_internal[right_most_idx].child[CHILD_THIRD] != POINTER_NULL_INT)
-								right_most_idx = spat_internal[right_most_idx].child[CHILD_THIRD];
-							else if(spat_internal[right_most_idx].child[CHILD_TWO] != POINTER_NULL_INT)
-								right_most_idx = spat_internal[right_most_idx].child[CHILD_TWO];
-							else if(spat_internal[right_most_idx].child[CHILD_ONE] != POINTER_NULL_INT)
-								right_most_idx = spat_internal[right_most_idx].child[CHILD_ONE];
-							else
-								right_most_idx = spat_internal[right_most_idx].child[CHILD_ZERO];
-						}
-						PREV_IDX = right_most_idx;
-						NEXT_IDX = spat_leaf[PREV_IDX].next;
-					}
-					else{ /* CHILD_ONE, CHILD_TWO */
-						// check the right side
-						int way_flag = -1;
-						unsigned left_most_idx = LAST_IDX;
-						unsigned right_most_idx = LAST_IDX;
-						for(int j = LAST_BIT + 1; j <= CHILD_THIRD; j++){
-							if(spat_internal[left_most_idx].child[j] != POINTER_NULL_INT){
-								left_most_idx = spat_internal[left_most_idx].child[j];
-								way_flag = 1;
-								break;
-							}
-						}
+						// Check the right-most node's idx on sub-trie
+						for(int j = LAST_ITER + 1; j <= s2_level; j++){
+							if(spat_internal[right_most_idx].child[CHILD_THIRD] != POINTER_NULL_INT)
+								right_most_idx = spat_internal[right_most_idx].child[CHILD_THIRD];
+							else if(spat_internal[right_most_idx].child[CHILD_TWO] != POINTER_NULL_INT)
+								right_most_idx = spat_internal[right_most_idx].child[CHILD_TWO];
+							else if(spat_internal[right_most_idx].child[CHILD_ONE] != POINTER_NULL_INT)
+								right_most_idx = spat_internal[right_most_idx].child[CHILD_ONE];
+							else
+								right_most_idx = spat_internal[right_most_idx].child[CHILD_ZERO];
+						}
+						PREV_IDX = right_most_idx;
+						NEXT_IDX = spat_leaf[PREV_IDX].next;
+					}
+					else{ /* CHILD_ONE, CHILD_TWO */
+						// check the right side
+						int way_flag = -1;
+						unsigned left_most_idx = LAST_IDX;
+						unsigned right_most_idx = LAST_IDX;
+						for(int j = LAST_BIT + 1; j <= CHILD_THIRD; j++){
+							if(spat_internal[left_most_idx].child[j] != POINTER_NULL_INT){
+								left_most_idx = spat_internal[left_most_idx].child[j];
+								way_flag = 1;
+								break;
+							}
+						}
+
+						if(way_flag > 0){
+							for(int j = LAST_ITER + 1; j <= s2_level; j++){
+								if(spat_internal[left_most_idx].child[CHILD_ZERO] != POINTER_NULL_INT)
+									left_most_idx = spat_internal[left_most_idx].child[CHILD_ZERO];
+								else if(spat_internal[left_most_idx].child[CHILD_ONE] != POINTER_NULL_INT)
+									left_most_idx = spat_internal[left_most_idx].child[CHILD_ONE];
+								else if(spat_internal[left_most_idx].child[CHILD_TWO] != POINTER_NULL_INT)
+									left_most_idx = spat_internal[left_most_idx].child[CHILD_TWO];
+								else
+									left_most_idx = spat_internal[left_most_idx].child[CHILD_THIRD];
+							}
+							NEXT_IDX = left_most_idx;
+							PREV_IDX = spat_leaf[NEXT_IDX].prev;
+						}
+						else {
+							for(int j = LAST_BIT - 1; j >= CHILD_ZERO; j--){
+								if(spat_internal[right_most_idx].child[j] != POINTER_NULL_INT){
+									right_most_idx = spat_internal[right_most_idx].child[j];
+									break;
+								}
+							}
+							
+							for(int j = LAST_ITER + 1; j <= s2_level; j++){
+								if(spat_internal[right_most_idx].child[CHILD_THIRD] != POINTER_NULL_INT)
+									right_most_idx = spat_internal[right_most_idx].child[CHILD_THIRD];
+								else if(spat_internal[right_most_idx].child[CHILD_TWO] != POINTER_NULL_INT)
+									right_most_idx = spat_internal[right_most_idx].child[CHILD_TWO];
+								else if(spat_internal[right_most_idx].child[CHILD_ONE] != POINTER_NULL_INT)
+									right_most_idx = spat_internal[right_most_idx].child[CHILD_ONE];
+								else
+									right_most_idx = spat_internal[right_most_idx].child[CHILD_ZERO];
+							}
+							PREV_IDX = right_most_idx;
+							NEXT_IDX = spat_leaf[PREV_IDX].next;
+						}
+					}
+				}
+				else{
+					// Find insertion point: Using LINKED-LIST
+					if (spat_leaf[PIVOT] < spat_leaf[v]) {
+						PREV_IDX = PIVOT;			
+						while (PREV_IDX != POINTER_NULL_INT && spat_leaf[PREV_IDX] < spat_leaf[v]) {
+							NEXT_IDX = spat_leaf[PREV_IDX].next;
+							if (NEXT_IDX == POINTER_NULL_INT || spat_leaf[NEXT_IDX] > spat_leaf[v]) {
+								break;
+							}
+							PREV_IDX = NEXT_IDX;
+						}
+					} else {
+						NEXT_IDX = PIVOT;
+						while (NEXT_IDX != POINTER_NULL_INT && spat_leaf[NEXT_IDX] > spat_leaf[v]) {
+							PREV_IDX = spat_leaf[NEXT_IDX].prev;
+							if (PREV_IDX == POINTER_NULL_INT || spat_leaf[PREV_IDX] < spat_leaf[v]) {
+								break;
+							}
+							NEXT_IDX = PREV_IDX;
+						}
+					}
+				}
+
+				spat_leaf[v].prev = PREV_IDX;
+				spat_leaf[v].next = NEXT_IDX;
+
+				// Update previous node pointer
+				if (PREV_IDX != POINTER_NULL_INT) {
+					publish_link(spat_leaf[PREV_IDX].next, v);
+				}
+
+				// Update next node pointer
+				if (NEXT_IDX != POINTER_NULL_INT) {
+					publish_link(spat_leaf[NEXT_IDX].prev, v);
+				}
+				break;
+			}
+		}
+		PIVOT_IDX = u;
+
+		// 7 - Publish the branch
+		publish_link(*ATTACH_LINK, BRANCH_IDX);
+	}
+	return u;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+void TST<DATA, T_RES, S2_RES>::Delete(unsigned int encoded_temp, unsigned long long encoded_spat, DATA data) {
+	check_writable();
+	if(wal) log_op(LOG_DELETE, encoded_temp, encoded_spat, data); // Replaying a delete that found nothing is a no-op
+	remove_data(encoded_temp, encoded_spat, data);
+	retire();
+	if(wal) log_commit();
+	return;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+bool TST<DATA, T_RES, S2_RES>::remove_data(unsigned int encoded_temp, unsigned long long encoded_spat, const DATA& data) {
+	// Returns true when the data was found and erased
+	int i, bit;
+	unsigned u = ROOT_IDX;
+	std::stack<unsigned> path_idx;
+	path_idx.push(ROOT_IDX);
+
+	// 1 - Search for the existence of a path in the trie with a time prefix.
+	for(i = 1; i <= temp_len; i++){
+		bit = (encoded_temp >> (temp_len - i)) & 1;
+		if(temp_internal[u].child[bit] == POINTER_NULL_INT){
+			std::cerr << "[Warning] Does not exist in the temporal trie. Deletion skipped." << std::endl;
+			return false;
+		}
+		u = temp_internal[u].child[bit];
+		path_idx.push(u);
+	}
+	
+
+	// 2 - Search for the existence of a path in the trie with a space suffix.
+	// 2-1 - Check the leading 3 bits.
+	int lead_3bits = (encoded_spat >> (spat_len - 3)) & 0b111;
+	if(temp_leaf[u].child[lead_3bits] == POINTER_NULL_INT) {
+		std::cerr << "[Warning] Does not exist in the spatial trie. Deletion skipped." << std::endl;
+		return false;
+	}
+	int TIME_IDX = u, spat_path[31];
+	u = temp_leaf[u].child[lead_3bits];
+	path_idx.push(u);
+	spat_path[0] = u;
+
+	// 2-2 - Check in 2-bit increments
+	for(i = 1; i <= s2_level; i++){
+		bit = (encoded_spat >> (spat_len - 3 - 2*i)) & 0b11;
+		if(spat_internal[u].child[bit] == POINTER_NULL_INT){
+			std::cerr << "[Warning] Does not exist in the spatial trie. Deletion skipped." << std::endl;
+			return false;
+		}
+		u = spat_internal[u].child[bit];
+		path_idx.push(u);
+		spat_path[i] = u;
+	}
+
+	/* 3 -  Delete the actual data referenced by the node. */ 
+	if(!spat_leaf[u].erase_data(data, data_arena)){
+		std::cerr << "[Warning] Leaf node does not reference a valid data. "
+          			<< "Possible missing or null data. Deletion skipped." << std::endl;
+		return false;
+	}
+	add_count(TIME_IDX, spat_path, -1);
+
+	// Idx Checker
+	if(u != path_idx.top()){
+		std::cerr << "[Warning] The final index does not match." << std::endl;
+	}
+	path_idx.pop();
+
+	// 3-1 - Disable the spatial leaf node
+	if(spat_leaf[u].size() == 0){
+		// Detach target node from the doubly linked list. Its own links stay intact
+		// until the slot is reclaimed, so a reader standing on it can still move on.
+		int PREV_IDX = spat_leaf[u].prev;
+		int NEXT_IDX = spat_leaf[u].next;
+
+		// Spatial Trie Leaf Node
+		switch (spat_leaf.live()) {
+			case 1:
+				break; // ROOT Free
+			case 2: {
+				unsigned other = (PREV_IDX != POINTER_NULL_INT) ? PREV_IDX : NEXT_IDX;
+				publish_link(spat_leaf[other].prev, POINTER_NULL_INT);
+				publish_link(spat_leaf[other].next, POINTER_NULL_INT);
+				break;
+			}
+			default: {
+				if(PREV_IDX != POINTER_NULL_INT)
+					publish_link(spat_leaf[PREV_IDX].next, NEXT_IDX);
+				if(NEXT_IDX != POINTER_NULL_INT)
+					publish_link(spat_leaf[NEXT_IDX].prev, PREV_IDX);
+				break;
+			}
+		}
+
+		// Hand the slot to the free list and keep the linked-list entry alive
+		if((int)u == PIVOT_IDX)
+			PIVOT_IDX = (PREV_IDX != POINTER_NULL_INT) ? PREV_IDX : NEXT_IDX;
+		spat_leaf[u].release_payload(data_arena);
+		spat_leaf.release(u);
+	}
+	else // Do not need to deactivate the node
+		return true;
+
+
+	// 3-2 - Check whether the spatial internal node (2-bits) should be disabled
+	u = path_idx.top();
+	for(i = s2_level; i >= 1; i--){
+		bit = (encoded_spat >> (spat_len - 3 - 2*i)) & 0b11;
+		publish_link(spat_internal[u].child[bit], POINTER_NULL_INT);
+
+		for(int j = CHILD_ZERO; j <= CHILD_THIRD; j++){
+			if(spat_internal[u].child[j] != POINTER_NULL_INT)
+				return true; // There are child nodes more than one 
+		}
+		spat_internal.release(u);
+
+		// If there is no more child node, then deactivate
+		path_idx.pop();
+		u = path_idx.top();
+	}
+
+	// 3-3 - Check whether the temporal leaf node should be disabled
+	publish_link(temp_leaf[u].child[lead_3bits], POINTER_NULL_INT);
+	for(int j = CHILD_ZERO; j <= CHILD_SEVENTH; j++){
+		if(temp_leaf[u].child[j] != POINTER_NULL_INT)
+			return true;
+	}
+
+	// Detach temporal leaf node from the doubly linked list (its own links stay intact)
+	int PREV_IDX = temp_leaf[u].prev;
+	int NEXT_IDX = temp_leaf[u].next;
+
+	switch (temp_leaf.live()) {
+		case 1:
+			break; // ROOT Free
+		case 2: {
+			unsigned other = (PREV_IDX != POINTER_NULL_INT) ? PREV_IDX : NEXT_IDX;
+			publish_link(temp_leaf[other].prev, POINTER_NULL_INT);
+			publish_link(temp_leaf[other].next, POINTER_NULL_INT);
+			break;
+		}
+		default: {
+			if(PREV_IDX != POINTER_NULL_INT)
+				publish_link(temp_leaf[PREV_IDX].next, NEXT_IDX);
+			if(NEXT_IDX != POINTER_NULL_INT)
+				publish_link(temp_leaf[NEXT_IDX].prev, PREV_IDX);
+			break;
+		}
+	}
+	temp_leaf.release(u);
+
+	// 3-4 - Check whether the temporal internal node (1-bit) should be disabled
+	for(i = temp_len; i >= 1; i--){
+		path_idx.pop();
+		u = path_idx.top();
+
+		bit = (encoded_temp >> (temp_len - i)) & 1;
+		publish_link(temp_internal[u].child[bit], POINTER_NULL_INT);
+		
+		if(temp_internal[u].child[1-bit] != POINTER_NULL_INT || u == ROOT_IDX)
+			return true;
+		temp_internal.release(u);
+	}
+
+	return true;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+bool TST<DATA, T_RES, S2_RES>::key_order(const std::tuple<unsigned int, unsigned long long, DATA>& a,
+						const std::tuple<unsigned int, unsigned long long, DATA>& b) {
+	// Orders records by (time, S2) key only; DATA does not need to be comparable
+	if(std::get<0>(a) != std::get<0>(b)) return std::get<0>(a) < std::get<0>(b);
+	return std::get<1>(a) < std::get<1>(b);
+}
+
+template<class DATA, int T_RES, int S2_RES>
+void TST<DATA, T_RES, S2_RES>::shared_prefix(const std::tuple<unsigned int, unsigned long long, DATA>& prev,
+						const std::tuple<unsigned int, unsigned long long, DATA>& cur, int& depth, int& level) const {
+	// Trie prefix shared by two keys in sorted order:
+	// depth = # of shared temporal bits, level = deepest shared spatial level (-1: none)
+	depth = 0;
+	level = -1;
+	if(std::get<0>(cur) != std::get<0>(prev)){
+		depth = temp_len - 32 + __builtin_clz(std::get<0>(cur) ^ std::get<0>(prev));
+		return;
+	}
+	depth = temp_len;
+	if(std::get<1>(cur) == std::get<1>(prev)){
+		level = s2_level;
+		return;
+	}
+	int shared_bits = spat_len - 64 + __builtin_clzll(std::get<1>(cur) ^ std::get<1>(prev));
+	level = (shared_bits < 3) ? -1 : (shared_bits - 3) / 2;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+void TST<DATA, T_RES, S2_RES>::InsertBatch(std::vector<Record>& batch) {
+	check_writable();
+	if(wal){
+		for(const Record& record : batch)
+			log_op(LOG_INSERT, std::get<0>(record), std::get<1>(record), std::get<2>(record));
+	}
+
+	// 1 - Sort by (time, S2) key so consecutive records share trie prefixes
+	parallel_stable_sort(batch.begin(), batch.end(), key_order);
+
+	// 2 - Each record only walks the part of the path that differs from the previous one
+	int temp_path[33], spat_path[31]; // Node index at each depth / level
+	temp_path[0] = ROOT_IDX;
+	for(size_t r = 0; r < batch.size(); r++){
+		unsigned int encoded_temp = std::get<0>(batch[r]);
+		unsigned long long encoded_spat = std::get<1>(batch[r]);
+		int depth = 0, level = -1;
+		if(r > 0) shared_prefix(batch[r - 1], batch[r], depth, level);
+
+		if(depth != temp_len)
+			insert_temp(encoded_temp, temp_path, depth);
+		if(level != s2_level)
+			insert_spat(encoded_temp, encoded_spat, temp_path[temp_len], spat_path, level);
+
+		// Data Pointing (Insert into data vector)
+		spat_leaf[spat_path[s2_level]].insert_data(std::get<2>(batch[r]), data_arena);
+		add_count(temp_path[temp_len], spat_path, 1);
+	}
+
+	if(wal) log_commit();
+	return;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+template<class ITER>
+void TST<DATA, T_RES, S2_RES>::bulk_load(ITER first, ITER last) {
+	check_writable();
+	if(spat_leaf.live() != 0){
+		throw std::logic_error("bulk_load requires an empty index. Call clear() first or use Insert.");
+	}
 
-						if(way_flag > 0){
-							for(int j = LAST_ITER + 1; j <= s2_level; j++){
-								if(spat_internal[left_most_idx].child[CHILD_ZERO] != POINTER_NULL_INT)
-									left_most_idx = spat_internal[left_most_idx].child[CHILD_ZERO];
-								else if(spat_internal[left_most_idx].child[CHILD_ONE] != POINTER_NULL_INT)
-									left_most_idx = spat_internal[left_most_idx].child[CHILD_ONE];
-								else if(spat_internal[left_most_idx].child[CHILD_TWO] != POINTER_NULL_INT)
-									left_most_idx = spat_internal[left_most_idx].child[CHILD_TWO];
-								else
-									left_most_idx = spat_internal[left_most_idx].child[CHILD_THIRD];
-							}
-							NEXT_IDX = left_most_idx;
-							PREV_IDX = spat_leaf[NEXT_IDX].prev;
-						}
-						else {
-							for(int j = LAST_BIT - 1; j >= CHILD_ZERO; j--){
-								if(spat_internal[right_most_idx].child[j] != POINTER_NULL_INT){
-									right_most_idx = spat_internal[right_most_idx].child[j];
-									break;
-								}
-							}
-							
-							for(int j = LAST_ITER + 1; j <= s2_level; j++){
-								if(spat_internal[right_most_idx].child[CHILD_THIRD] != POINTER_NULL_INT)
-									right_most_idx = spat_internal[right_most_idx].child[CHILD_THIRD];
-								else if(spat_internal[right_most_idx].child[CHILD_TWO] != POINTER_NULL_INT)
-									right_most_idx = spat_internal[right_most_idx].child[CHILD_TWO];
-								else if(spat_internal[right_most_idx].child[CHILD_ONE] != POINTER_NULL_INT)
-									right_most_idx = spat_internal[right_most_idx].child[CHILD_ONE];
-								else
-									right_most_idx = spat_internal[right_most_idx].child[CHILD_ZERO];
-							}
-							PREV_IDX = right_most_idx;
-							NEXT_IDX = spat_leaf[PREV_IDX].next;
-						}
-					}
+	std::vector<Record> records(first, last);
+	if(wal){
+		for(const Record& record : records)
+			log_op(LOG_INSERT, std::get<0>(record), std::get<1>(record), std::get<2>(record));
+	}
+	reset();
+	if(records.empty()) return;
+
+	// 1 - Sort by (time, S2) key; records with equal keys keep their input order
+	parallel_stable_sort(records.begin(), records.end(), key_order);
+
+	// 2 - Count the nodes so every pool is allocated once
+	size_t n_temp_internal = 1, n_temp_leaf = 0, n_spat_internal = 0, n_spat_leaf = 0;
+	for(size_t r = 0; r < records.size(); r++){
+		int depth = 0, level = -1;
+		if(r > 0) shared_prefix(records[r - 1], records[r], depth, level);
+		if(depth != temp_len){
+			n_temp_internal += temp_len - 1 - depth;
+			n_temp_leaf++;
+		}
+		if(level != s2_level){
+			n_spat_internal += s2_level - 1 - level;
+			n_spat_leaf++;
+		}
+	}
+	temp_internal.reserve(n_temp_internal);
+	temp_leaf.reserve(n_temp_leaf);
+	spat_internal.reserve(n_spat_internal);
+	spat_leaf.reserve(n_spat_leaf);
+
+	// 3 - Single sweep: only the suffix that differs from the previous key is created,
+	//     and both linked lists are appended to in key order
+	std::vector<int> temp_path(temp_len + 1), spat_path(s2_level + 1);
+	temp_path[0] = ROOT_IDX;
+	int LAST_TEMP = POINTER_NULL_INT, LAST_SPAT = POINTER_NULL_INT;
+
+	for(size_t r = 0; r < records.size(); r++){
+		unsigned int encoded_temp = std::get<0>(records[r]);
+		unsigned long long encoded_spat = std::get<1>(records[r]);
+		int depth = 0, level = -1, bit;
+		if(r > 0) shared_prefix(records[r - 1], records[r], depth, level);
+
+		// 3-1 - Temporal suffix
+		if(depth != temp_len){
+			for(int i = depth + 1; i <= temp_len; i++){
+				bit = (encoded_temp >> (temp_len - i)) & 1;
+				int NEW_IDX = (i != temp_len) ? temp_internal.append() : temp_leaf.append();
+				temp_internal[temp_path[i - 1]].child[bit] = NEW_IDX;
+				temp_path[i] = NEW_IDX;
+			}
+
+			int v = temp_path[temp_len];
+			temp_leaf[v].ENCODED_TIME = encoded_temp;
+			temp_leaf[v].prev = LAST_TEMP;
+			if(LAST_TEMP != POINTER_NULL_INT) temp_leaf[LAST_TEMP].next = v;
+			LAST_TEMP = v;
+		}
+
+		// 3-2 - Spatial suffix
+		if(level != s2_level){
+			if(level < 0){
+				int lead_3bits = (encoded_spat >> (spat_len - 3)) & 0b111;
+				spat_path[0] = spat_internal.append();
+				temp_leaf[temp_path[temp_len]].child[lead_3bits] = spat_path[0];
+				level = 0;
+			}
+			for(int i = level + 1; i <= s2_level; i++){
+				bit = (encoded_spat >> (spat_len - 3 - 2*i)) & 0b11;
+				int NEW_IDX = (i != s2_level) ? spat_internal.append() : spat_leaf.append();
+				spat_internal[spat_path[i - 1]].child[bit] = NEW_IDX;
+				spat_path[i] = NEW_IDX;
+			}
+
+			int v = spat_path[s2_level];
+			spat_leaf[v].ENCODED_TIME = encoded_temp;
+			spat_leaf[v].S2_ID = encoded_spat;
+			spat_leaf[v].prev = LAST_SPAT;
+			if(LAST_SPAT != POINTER_NULL_INT) spat_leaf[LAST_SPAT].next = v;
+			LAST_SPAT = v;
+		}
+
+		spat_leaf[spat_path[s2_level]].insert_data(std::get<2>(records[r]), data_arena);
+		add_count(temp_path[temp_len], spat_path.data(), 1);
+	}
+	PIVOT_IDX = LAST_SPAT;
+
+	if(wal) log_commit();
+	return;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+Spatial_Plan TST<DATA, T_RES, S2_RES>::REC_S2_FINDER(std::vector<double>& left_bottom, std::vector<double>& right_upper) {
+	S2LatLngRect rect = S2LatLngRect::FromPointPair(S2LatLng::FromDegrees(left_bottom[0], left_bottom[1]), S2LatLng::FromDegrees(right_upper[0], right_upper[1]));
+	return REGION_S2_FINDER(rect);
+}
+
+template<class DATA, int T_RES, int S2_RES>
+Spatial_Plan TST<DATA, T_RES, S2_RES>::REGION_S2_FINDER(const S2Region& region) {
+	S2RegionCoverer::Options options;
+	options.set_max_level(s2_level);
+	options.set_max_cells(MAXCELL);
+	S2RegionCoverer coverer(options);
+	S2CellUnion covering = coverer.GetCovering(region);
+
+	/* Identify the S2 Cells within the queried space */
+	unsigned long long number_of_cells = covering.size();
+	std::map<int, std::vector<unsigned long long>> levelMap; // S2 Cell level map
+
+	for(unsigned long long i = 0; i < number_of_cells; i++){
+		unsigned long long s2_search_id = covering.cell_id(i).id();
+		int level = covering.cell_id(i).level();
+
+		if (levelMap.find(level) == levelMap.end()) {
+			levelMap[level] = std::vector<unsigned long long>{s2_search_id};
+		} else {
+			levelMap[level].push_back(s2_search_id);
+		}
+	}
+
+	// Cells inside the region need no exact test on their values; the rest only intersect its boundary
+	Spatial_Plan plan = compile_plan(levelMap);
+	for(unsigned long long i = 0; i < number_of_cells; i++){
+		if(region.Contains(S2Cell(covering.cell_id(i))))
+			plan.mark_interior(covering.cell_id(i).id(), covering.cell_id(i).level());
+	}
+	return plan;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+Spatial_Plan TST<DATA, T_RES, S2_RES>::POLYLINE_S2_FINDER(const S2Polyline& polyline, S1Angle radius) {
+	return REGION_S2_FINDER(Polyline_Buffer(polyline, radius));
+}
+
+template<class DATA, int T_RES, int S2_RES>
+Spatial_Plan TST<DATA, T_RES, S2_RES>::ADAPTIVE_S2_FINDER(const S2Region& region, unsigned int encoded_start_time, unsigned int encoded_end_time) {
+	// The levels of the covering follow the subtree counts of the bins in the window: a cell is split while dropping
+	// its children outside the region (or without data) saves more scanned values than the extra descents cost.
+	// Cells empty in every bin are left out, so the plan only fits the data present when it is built.
+	Read_Section section(*epochs);
+	std::vector<int> bins;
+	int TIME_IDX = trav_temp(encoded_start_time);
+	while(TIME_IDX != POINTER_NULL_INT && temp_leaf[TIME_IDX].ENCODED_TIME < encoded_end_time){
+		bins.push_back(TIME_IDX);
+		TIME_IDX = load_link(temp_leaf[TIME_IDX].next);
+	}
+
+	int budget = MAXCELL; // # of cells that may still be split
+	std::vector<std::pair<S2CellId, bool>> chosen; // (cell, interior)
+	for(int lead_3bits = 0; lead_3bits < 6; lead_3bits++){
+		S2CellId cell = S2CellId::FromFace(lead_3bits);
+		if(!region.MayIntersect(S2Cell(cell))) continue;
+		std::vector<int> nodes; // The cell's node in every bin that has it
+		for(int BIN_IDX : bins){
+			int u = load_link(temp_leaf[BIN_IDX].child[lead_3bits]);
+			if(u != POINTER_NULL_INT) nodes.push_back(u);
+		}
+		if(!nodes.empty()) plan_cell(region, cell, nodes, budget, chosen);
+	}
+
+	std::map<int, std::vector<unsigned long long>> levelMap;
+	for(const auto& CELL : chosen) levelMap[CELL.first.level()].push_back(CELL.first.id());
+	Spatial_Plan plan = compile_plan(levelMap);
+	for(const auto& CELL : chosen)
+		if(CELL.second) plan.mark_interior(CELL.first.id(), CELL.first.level());
+	return plan;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+double TST<DATA, T_RES, S2_RES>::plan_cell(const S2Region& region, S2CellId cell, const std::vector<int>& nodes, int& budget,
+							std::vector<std::pair<S2CellId, bool>>& chosen) {
+	// Returns the cheapest cost of the cell's part of the region: PLAN_DESCENT_COST per planned cell + values scanned
+	int level = cell.level();
+	double values = 0;
+	for(int u : nodes)
+		values += (level == s2_level) ? spat_leaf[u].load_count() : __atomic_load_n(&spat_internal[u].count, __ATOMIC_RELAXED);
+	if(values == 0) return 0;
+
+	double keep = PLAN_DESCENT_COST + values;
+	bool inside = region.Contains(S2Cell(cell));
+	if(inside || level == s2_level || budget <= 0){
+		chosen.push_back(std::make_pair(cell, inside));
+		return keep;
+	}
+	budget--;
+
+	size_t mark = chosen.size();
+	double split = 0;
+	std::vector<int> child_nodes;
+	for(int bit = CHILD_ZERO; bit <= CHILD_THIRD && split < keep; bit++){
+		S2CellId child = cell.child(bit);
+		if(!region.MayIntersect(S2Cell(child))) continue;
+		child_nodes.clear();
+		for(int u : nodes){
+			int v = load_link(spat_internal[u].child[bit]);
+			if(v != POINTER_NULL_INT) child_nodes.push_back(v);
+		}
+		if(!child_nodes.empty()) split += plan_cell(region, child, child_nodes, budget, chosen);
+	}
+	if(split < keep) return split;
+	chosen.resize(mark);
+	chosen.push_back(std::make_pair(cell, false));
+	return keep;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+Spatial_Plan TST<DATA, T_RES, S2_RES>::compile_plan(const std::map<int, std::vector<unsigned long long>>& level_map) const {
+	return Spatial_Plan(level_map, s2_level, spat_len);
+}
+
+template<class DATA, int T_RES, int S2_RES>
+void TST<DATA, T_RES, S2_RES>::range_search(const std::map<int, std::vector<unsigned long long>>& S2_LEVEL_MAP, 
+									unsigned int encoded_start_time, unsigned int encoded_end_time, std::vector<DATA>& res) {
+	range_search(compile_plan(S2_LEVEL_MAP), encoded_start_time, encoded_end_time, res);
+}
+
+template<class DATA, int T_RES, int S2_RES>
+void TST<DATA, T_RES, S2_RES>::range_search(const Spatial_Plan& plan, 
+									unsigned int encoded_start_time, unsigned int encoded_end_time, std::vector<DATA>& res) {
+	check_plan(plan);
+	// Lock-free with respect to one concurrent writer: the reader only announces its epoch
+	Read_Section section(*epochs);
+
+	// Finds the time node closest to the starting point
+	Query_Cache<DATA>* cache = query_cache.get();
+	int TIME_IDX = trav_temp(encoded_start_time);
+	while(TIME_IDX != POINTER_NULL_INT && temp_leaf[TIME_IDX].ENCODED_TIME < encoded_end_time){
+		if(cache == nullptr) trav_spat(plan, TIME_IDX, res);
+		else{ // Only bins changed since their result was cached are traversed again
+			unsigned int bin_time = temp_leaf[TIME_IDX].ENCODED_TIME;
+			uint64_t generation;
+			if(!cache->lookup(plan.fingerprint(), bin_time, res, generation)){
+				size_t first = res.size();
+				trav_spat(plan, TIME_IDX, res);
+				cache->store(plan.fingerprint(), bin_time, generation, res.data() + first, res.size() - first);
+			}
+		}
+		TIME_IDX = load_link(temp_leaf[TIME_IDX].next);
+	}
+	return;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+void TST<DATA, T_RES, S2_RES>::parallel_range_search(const Spatial_Plan& plan,
+									unsigned int encoded_start_time, unsigned int encoded_end_time, std::vector<DATA>& res, int n_threads) {
+	check_plan(plan);
+	// The caller's epoch also covers the workers: nothing they can reach is recycled before it ends
+	Read_Section section(*epochs);
+
+	// 1 - Collect the time bins of the window
+	std::vector<int> bins;
+	int TIME_IDX = trav_temp(encoded_start_time);
+	while(TIME_IDX != POINTER_NULL_INT && temp_leaf[TIME_IDX].ENCODED_TIME < encoded_end_time){
+		bins.push_back(TIME_IDX);
+		TIME_IDX = load_link(temp_leaf[TIME_IDX].next);
+	}
+
+	if(n_threads <= 0) n_threads = std::max(1u, std::thread::hardware_concurrency());
+	n_threads = std::min<int>(n_threads, bins.size());
+	if(n_threads <= 1){
+		for(int BIN_IDX : bins) trav_spat(plan, BIN_IDX, res);
+		return;
+	}
+
+	// 2 - Workers claim one bin at a time, so a few crowded bins do not hold up a whole thread's share.
+	//     Each worker appends to its own buffer and notes where every bin it searched ends.
+	std::vector<std::vector<DATA>> buffers(n_threads);
+	std::vector<std::vector<std::pair<size_t, size_t>>> spans(n_threads); // (bin ordinal, end offset in the buffer)
+	std::atomic<size_t> next(0);
+	auto worker = [&](int t) {
+		for(size_t b = next++; b < bins.size(); b = next++){
+			trav_spat(plan, bins[b], buffers[t]);
+			spans[t].emplace_back(b, buffers[t].size());
+		}
+	};
+	std::vector<std::thread> workers;
+	for(int t = 1; t < n_threads; t++) workers.emplace_back(worker, t);
+	worker(0);
+	for(auto& w : workers) w.join();
+
+	// 3 - Concatenate in bin order, so the result matches range_search
+	std::vector<std::tuple<int, size_t, size_t>> order(bins.size()); // (buffer, begin, end)
+	size_t total = 0;
+	for(int t = 0; t < n_threads; t++){
+		size_t begin = 0;
+		for(const auto& span : spans[t]){
+			order[span.first] = std::make_tuple(t, begin, span.second);
+			begin = span.second;
+		}
+		total += buffers[t].size();
+	}
+	res.reserve(res.size() + total);
+	for(const auto& piece : order){
+		const std::vector<DATA>& buffer = buffers[std::get<0>(piece)];
+		res.insert(res.end(), buffer.begin() + std::get<1>(piece), buffer.begin() + std::get<2>(piece));
+	}
+	return;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+void TST<DATA, T_RES, S2_RES>::range_search_batch(const Plan_Batch& batch, const std::vector<std::pair<unsigned int, unsigned int>>& windows,
+									std::vector<std::vector<DATA>>& res) {
+	// The time bins of the union of the windows are walked once. In each bin, a prefix shared by several plans
+	// is descended once and a cell's leaves are read once for every plan that has it in its window.
+	// res[q] gets exactly what range_search(plan q, window q) would append.
+	if(windows.size() != batch.size()){
+		throw std::invalid_argument("range_search_batch needs one time window per plan of the batch.");
+	}
+	if(batch.getSpat_len() != spat_len){
+		throw std::invalid_argument("The plan batch was compiled for an index with a different S2 level.");
+	}
+	res.resize(windows.size());
+	unsigned int first_time = ~0u, last_time = 0;
+	bool shared_window = true; // Then every step of the batch is live in every bin
+	for(const auto& WINDOW : windows){
+		if(WINDOW.first >= WINDOW.second) continue;
+		first_time = std::min(first_time, WINDOW.first);
+		last_time = std::max(last_time, WINDOW.second);
+		shared_window &= (WINDOW == windows[0]);
+	}
+	if(first_time >= last_time) return;
+
+	// Otherwise, the union of the windows of the plans at or below each step (children follow their parent)
+	std::vector<std::pair<unsigned int, unsigned int>> span;
+	if(!shared_window){
+		span.assign(batch.steps.size(), std::make_pair(~0u, 0u));
+		for(int u = (int)batch.steps.size() - 1; u >= 0; u--){
+			const Plan_Batch::Step& step = batch.steps[u];
+			for(int o = step.owners; o != POINTER_NULL_INT; o = batch.owner_list[o].second){
+				const auto& WINDOW = windows[batch.owner_list[o].first];
+				if(WINDOW.first >= WINDOW.second) continue;
+				span[u].first = std::min(span[u].first, WINDOW.first);
+				span[u].second = std::max(span[u].second, WINDOW.second);
+			}
+			for(int c : step.child){
+				if(c == POINTER_NULL_INT) continue;
+				span[u].first = std::min(span[u].first, span[c].first);
+				span[u].second = std::max(span[u].second, span[c].second);
+			}
+		}
+	}
+
+	Read_Section section(*epochs);
+	const Node_S* S_INTER = spat_internal.data();
+	const Data_Node<DATA>* S_LEAF = spat_leaf.data();
+	const int S2_LEVEL = s2_level;
+	std::vector<int> active;
+	std::vector<std::pair<int, int>> pending; // (batch step, subtrie node)
+
+	int TIME_IDX = trav_temp(first_time);
+	while(TIME_IDX != POINTER_NULL_INT && temp_leaf[TIME_IDX].ENCODED_TIME < last_time){
+		unsigned int bin_time = temp_leaf[TIME_IDX].ENCODED_TIME;
+		auto live = [&](int u) { return shared_window || (span[u].first <= bin_time && bin_time < span[u].second); };
+		for(int lead_3bits = CHILD_ZERO; lead_3bits <= CHILD_SEVENTH; lead_3bits++){
+			if(batch.root(lead_3bits) == POINTER_NULL_INT || !live(batch.root(lead_3bits))) continue;
+			int u = load_link(temp_leaf[TIME_IDX].child[lead_3bits]);
+			if(u == POINTER_NULL_INT) continue;
+
+			pending.assign(1, std::make_pair(batch.root(lead_3bits), u));
+			while(!pending.empty()){
+				const Plan_Batch::Step& step = batch.steps[pending.back().first];
+				u = pending.back().second;
+				pending.pop_back();
+
+				active.clear();
+				for(int o = step.owners; o != POINTER_NULL_INT; o = batch.owner_list[o].second){
+					const auto& WINDOW = windows[batch.owner_list[o].first];
+					if(WINDOW.first <= bin_time && bin_time < WINDOW.second) active.push_back(batch.owner_list[o].first);
 				}
-				else{
-					// Find insertion point: Using LINKED-LIST
-					if (spat_leaf[PIVOT] < spat_leaf[v]) {
-						PREV_IDX = PIVOT;			
-						while (PREV_IDX != POINTER_NULL_INT && spat_leaf[PREV_IDX] < spat_leaf[v]) {
-							NEXT_IDX = spat_leaf[PREV_IDX].next;
-							if (NEXT_IDX == POINTER_NULL_INT || spat_leaf[NEXT_IDX] > spat_leaf[v]) {
-								break;
-							}
-							PREV_IDX = NEXT_IDX;
-						}
-					} else {
-						NEXT_IDX = PIVOT;
-						while (NEXT_IDX != POINTER_NULL_INT && spat_leaf[NEXT_IDX] > spat_leaf[v]) {
-							PREV_IDX = spat_leaf[NEXT_IDX].prev;
-							if (PREV_IDX == POINTER_NULL_INT || spat_leaf[PREV_IDX] < spat_leaf[v]) {
-								break;
-							}
-							NEXT_IDX = PREV_IDX;
-						}
-					}
+				if(!active.empty()){ // Read the cell into the first plan's result, copy it to the others
+					std::vector<DATA>& out = res[active[0]];
+					size_t from = out.size();
+					if(step.level == S2_LEVEL) S_LEAF[u].get_data(out, data_arena);
+					else trav_cell(u, step.level, step.s2, [&](const Data_Node<DATA>& leaf) { leaf.get_data(out, data_arena); return true; });
+					for(size_t a = 1; a < active.size(); a++)
+						res[active[a]].insert(res[active[a]].end(), out.begin() + from, out.end());
 				}
+				if(step.level == S2_LEVEL) continue;
+				for(int bit = CHILD_THIRD; bit >= CHILD_ZERO; bit--){ // Pushed in reverse, so digits are visited in S2 order
+					if(step.child[bit] == POINTER_NULL_INT || !live(step.child[bit])) continue;
+					int child = load_link(S_INTER[u].child[bit]);
+					if(child != POINTER_NULL_INT) pending.push_back(std::make_pair(step.child[bit], child));
+				}
+			}
+		}
+		TIME_IDX = load_link(temp_leaf[TIME_IDX].next);
+	}
+	return;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+void TST<DATA, T_RES, S2_RES>::range_search_batch(const std::vector<Query>& queries, std::vector<std::vector<DATA>>& res) {
+	std::vector<const Spatial_Plan*> plans;
+	std::vector<std::pair<unsigned int, unsigned int>> windows;
+	for(const Query& QUERY : queries){
+		check_plan(*std::get<0>(QUERY));
+		plans.push_back(std::get<0>(QUERY));
+		windows.push_back(std::make_pair(std::get<1>(QUERY), std::get<2>(QUERY)));
+	}
+	range_search_batch(Plan_Batch(plans, s2_level, spat_len), windows, res);
+}
+
+template<class DATA, int T_RES, int S2_RES>
+size_t TST<DATA, T_RES, S2_RES>::range_count(const Spatial_Plan& plan, unsigned int encoded_start_time, unsigned int encoded_end_time) {
+	check_plan(plan);
+	Read_Section section(*epochs);
+
+	// A cell coarser than s2_level is answered from its subtree count
+	size_t total = 0;
+	const Node_S* S_INTER = spat_internal.data();
+	auto on_cell = [&](int u) { total += __atomic_load_n(&S_INTER[u].count, __ATOMIC_RELAXED); return true; };
+	auto on_leaf = [&](const Data_Node<DATA>& leaf, const Spatial_Plan::Step&) { total += leaf.load_count(); return true; };
+
+	int TIME_IDX = trav_temp(encoded_start_time);
+	while(TIME_IDX != POINTER_NULL_INT && temp_leaf[TIME_IDX].ENCODED_TIME < encoded_end_time){
+		trav_plan(plan, TIME_IDX, on_cell, on_leaf);
+		TIME_IDX = load_link(temp_leaf[TIME_IDX].next);
+	}
+	return total;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+size_t TST<DATA, T_RES, S2_RES>::range_count(unsigned int encoded_start_time, unsigned int encoded_end_time) {
+	Read_Section section(*epochs);
+	size_t total = 0;
+	int TIME_IDX = trav_temp(encoded_start_time);
+	while(TIME_IDX != POINTER_NULL_INT && temp_leaf[TIME_IDX].ENCODED_TIME < encoded_end_time){
+		total += __atomic_load_n(&temp_leaf[TIME_IDX].count, __ATOMIC_RELAXED);
+		TIME_IDX = load_link(temp_leaf[TIME_IDX].next);
+	}
+	return total;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+bool TST<DATA, T_RES, S2_RES>::next_bin(unsigned int encoded_time, unsigned int& bin) {
+	Read_Section section(*epochs);
+	int TIME_IDX = trav_temp(encoded_time);
+	if(TIME_IDX == POINTER_NULL_INT || temp_leaf[TIME_IDX].ENCODED_TIME < encoded_time) return false;
+	bin = temp_leaf[TIME_IDX].ENCODED_TIME;
+	return true;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+template<class FN>
+void TST<DATA, T_RES, S2_RES>::range_aggregate(const Spatial_Plan& plan, unsigned int encoded_start_time, unsigned int encoded_end_time, FN fn) {
+	// Values are handed to fn leaf by leaf, in range_search order; nothing is collected across leaves
+	check_plan(plan);
+	Read_Section section(*epochs);
+	const Data_Arena<DATA>& arena = data_arena;
+	auto on_leaf = [&](const Data_Node<DATA>& leaf, const Spatial_Plan::Step&) { leaf.for_each_data(arena, fn); return true; };
+
+	int TIME_IDX = trav_temp(encoded_start_time);
+	while(TIME_IDX != POINTER_NULL_INT && temp_leaf[TIME_IDX].ENCODED_TIME < encoded_end_time){
+		trav_plan(plan, TIME_IDX, [](int) { return false; }, on_leaf);
+		TIME_IDX = load_link(temp_leaf[TIME_IDX].next);
+	}
+	return;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+template<class FN>
+bool TST<DATA, T_RES, S2_RES>::range_visit(const Spatial_Plan& plan, unsigned int encoded_start_time, unsigned int encoded_end_time, FN fn) {
+	// Values arrive in range_search order as the leaves are reached; fn returns false to stop the query.
+	// Each leaf is copied into one reused buffer first, so fn may be slow without holding up a concurrent writer's leaf.
+	check_plan(plan);
+	Read_Section section(*epochs);
+	const Data_Arena<DATA>& arena = data_arena;
+	std::vector<DATA> leaf_values;
+	auto on_leaf = [&](const Data_Node<DATA>& leaf, const Spatial_Plan::Step&) {
+		leaf_values.clear();
+		leaf.get_data(leaf_values, arena);
+		for(const DATA& value : leaf_values)
+			if(!fn(value)) return false;
+		return true;
+	};
+
+	int TIME_IDX = trav_temp(encoded_start_time);
+	while(TIME_IDX != POINTER_NULL_INT && temp_leaf[TIME_IDX].ENCODED_TIME < encoded_end_time){
+		if(!trav_plan(plan, TIME_IDX, [](int) { return false; }, on_leaf)) return false;
+		TIME_IDX = load_link(temp_leaf[TIME_IDX].next);
+	}
+	return true;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+template<class FN>
+bool TST<DATA, T_RES, S2_RES>::range_visit_spans(const Spatial_Plan& plan, unsigned int encoded_start_time, unsigned int encoded_end_time, FN fn) {
+	// The spans point into the index and are valid only during the call. A value moved by a concurrent Delete
+	// may be missed here; use range_visit when a writer is running.
+	check_plan(plan);
+	Read_Section section(*epochs);
+	const Data_Arena<DATA>& arena = data_arena;
+	auto on_leaf = [&](const Data_Node<DATA>& leaf, const Spatial_Plan::Step&) { return leaf.for_each_span(arena, fn); };
+
+	int TIME_IDX = trav_temp(encoded_start_time);
+	while(TIME_IDX != POINTER_NULL_INT && temp_leaf[TIME_IDX].ENCODED_TIME < encoded_end_time){
+		if(!trav_plan(plan, TIME_IDX, [](int) { return false; }, on_leaf)) return false;
+		TIME_IDX = load_link(temp_leaf[TIME_IDX].next);
+	}
+	return true;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+void TST<DATA, T_RES, S2_RES>::range_search(const Spatial_Plan& plan, unsigned int encoded_start_time, unsigned int encoded_end_time,
+							std::vector<DATA>& res, size_t limit) {
+	// LIMIT: the first `limit` values of range_search
+	if(limit == 0) return;
+	size_t base = res.size();
+	range_visit(plan, encoded_start_time, encoded_end_time, [&](const DATA& value) {
+		res.push_back(value);
+		return res.size() - base < limit;
+	});
+	return;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+void TST<DATA, T_RES, S2_RES>::range_search(const Spatial_Plan& plan, unsigned int encoded_start_time, unsigned int encoded_end_time,
+							std::vector<DATA>& interior, std::vector<DATA>& boundary) {
+	// Values of cells inside the region are certain hits; values of boundary cells may lie outside it
+	check_plan(plan);
+	Read_Section section(*epochs);
+	const Data_Arena<DATA>& arena = data_arena;
+	auto on_leaf = [&](const Data_Node<DATA>& leaf, const Spatial_Plan::Step& step) {
+		leaf.get_data(step.interior ? interior : boundary, arena);
+		return true;
+	};
+
+	int TIME_IDX = trav_temp(encoded_start_time);
+	while(TIME_IDX != POINTER_NULL_INT && temp_leaf[TIME_IDX].ENCODED_TIME < encoded_end_time){
+		trav_plan(plan, TIME_IDX, [](int) { return false; }, on_leaf);
+		TIME_IDX = load_link(temp_leaf[TIME_IDX].next);
+	}
+	return;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+template<class D>
+void TST<DATA, T_RES, S2_RES>::range_search(const Spatial_Plan& plan, const S2LatLngRect& rect,
+							unsigned int encoded_start_time, unsigned int encoded_end_time, std::vector<D>& res) {
+	// Compared on the stored fixed-point coordinates: four integer comparisons per value
+	const int32_t lat_lo = (int32_t)std::ceil(rect.lat_lo().degrees() * 1e7), lat_hi = (int32_t)std::floor(rect.lat_hi().degrees() * 1e7);
+	const int32_t lng_lo = (int32_t)std::ceil(rect.lng_lo().degrees() * 1e7), lng_hi = (int32_t)std::floor(rect.lng_hi().degrees() * 1e7);
+	// An inverted longitude interval crosses the antimeridian: [lng_lo, 180] or [-180, lng_hi]
+	const bool lng_full = rect.lng().is_full(), lng_inverted = rect.lng().is_inverted();
+	refine_search(plan, encoded_start_time, encoded_end_time, res, [=](const DATA& v) {
+		const bool in_lng = lng_inverted ? (v.lng_e7 >= lng_lo) | (v.lng_e7 <= lng_hi)
+										 : (v.lng_e7 >= lng_lo) & (v.lng_e7 <= lng_hi);
+		return (v.lat_e7 >= lat_lo) & (v.lat_e7 <= lat_hi) & (lng_full | in_lng);
+	});
+}
+
+template<class DATA, int T_RES, int S2_RES>
+template<class D>
+void TST<DATA, T_RES, S2_RES>::range_search(const Spatial_Plan& plan, const S2Region& region,
+							unsigned int encoded_start_time, unsigned int encoded_end_time, std::vector<D>& res) {
+	refine_search(plan, encoded_start_time, encoded_end_time, res, [&](const DATA& v) { return region.Contains(v.point()); });
+}
 
-				spat_leaf[v].prev = PREV_IDX;
-				spat_leaf[v].next = NEXT_IDX;
+template<class DATA, int T_RES, int S2_RES>
+template<class INSIDE>
+void TST<DATA, T_RES, S2_RES>::refine_search(const Spatial_Plan& plan, unsigned int encoded_start_time, unsigned int encoded_end_time,
+							std::vector<DATA>& res, INSIDE inside) {
+	// Leaves of interior cells are copied whole; only boundary leaves test their values against the region
+	static_assert(is_located<DATA>::value, "Exact region queries need a TST over Located<...> values.");
+	check_plan(plan);
+	Read_Section section(*epochs);
+	const Data_Arena<DATA>& arena = data_arena;
+	std::vector<DATA> leaf_values;
+	auto on_leaf = [&](const Data_Node<DATA>& leaf, const Spatial_Plan::Step& step) {
+		if(step.interior){
+			leaf.get_data(res, arena);
+			return true;
+		}
+		leaf_values.clear();
+		leaf.get_data(leaf_values, arena);
+		size_t out = res.size();
+		res.resize(out + leaf_values.size());
+		for(const DATA& v : leaf_values){ // Branch-free: write every value, advance past the ones inside
+			res[out] = v;
+			out += inside(v) ? 1 : 0;
+		}
+		res.resize(out);
+		return true;
+	};
 
-				// Update previous node pointer
-				if (PREV_IDX != POINTER_NULL_INT) {
-					spat_leaf[PREV_IDX].next = v;
+	int TIME_IDX = trav_temp(encoded_start_time);
+	while(TIME_IDX != POINTER_NULL_INT && temp_leaf[TIME_IDX].ENCODED_TIME < encoded_end_time){
+		trav_plan(plan, TIME_IDX, [](int) { return false; }, on_leaf);
+		TIME_IDX = load_link(temp_leaf[TIME_IDX].next);
+	}
+	return;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+void TST<DATA, T_RES, S2_RES>::knn_search(double lat, double lng, size_t k, unsigned int encoded_start_time, unsigned int encoded_end_time,
+							std::vector<std::pair<DATA, S1Angle>>& res) {
+	// Best-first search over the subtries of every time bin in the window: nodes are expanded in order of the
+	// distance from the point to their S2 cell, so a leaf is reached only once no unexpanded cell can be closer.
+	// A value's distance is the distance to its leaf cell (level s2_level); values in the same cell tie.
+	if(k == 0) return;
+	Read_Section section(*epochs);
+	const Node_S* S_INTER = spat_internal.data();
+	const Data_Node<DATA>* S_LEAF = spat_leaf.data();
+	const int S2_LEVEL = s2_level;
+	const S2Point target = S2LatLng::FromDegrees(lat, lng).ToPoint();
+
+	struct Entry {
+		S1ChordAngle dist;
+		int level, idx; // Subtrie node (a spatial leaf at s2_level)
+		unsigned long long key; // Face and 2-bit digits down to the node
+		bool operator>(const Entry& other) const { return dist > other.dist; }
+	};
+	auto cell_distance = [&](unsigned long long key, int level) {
+		S2CellId cell((key << (61 - 2*level)) | (1ULL << (60 - 2*level)));
+		return S2Cell(cell).GetDistance(target);
+	};
+	std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> frontier;
+
+	int TIME_IDX = trav_temp(encoded_start_time);
+	while(TIME_IDX != POINTER_NULL_INT && temp_leaf[TIME_IDX].ENCODED_TIME < encoded_end_time){
+		for(int lead_3bits = CHILD_ZERO; lead_3bits <= CHILD_SEVENTH; lead_3bits++){
+			int u = load_link(temp_leaf[TIME_IDX].child[lead_3bits]);
+			if(u != POINTER_NULL_INT) frontier.push(Entry{cell_distance(lead_3bits, 0), 0, u, (unsigned long long)lead_3bits});
+		}
+		TIME_IDX = load_link(temp_leaf[TIME_IDX].next);
+	}
+
+	size_t base = res.size();
+	std::vector<DATA> values;
+	while(!frontier.empty() && res.size() - base < k){
+		Entry entry = frontier.top();
+		frontier.pop();
+		if(entry.level == S2_LEVEL){
+			values.clear();
+			S_LEAF[entry.idx].get_data(values, data_arena);
+			S1Angle distance = entry.dist.ToAngle();
+			for(size_t i = 0; i < values.size() && res.size() - base < k; i++)
+				res.emplace_back(values[i], distance);
+			continue;
+		}
+		for(int bit = CHILD_ZERO; bit <= CHILD_THIRD; bit++){
+			int child = load_link(S_INTER[entry.idx].child[bit]);
+			if(child == POINTER_NULL_INT) continue;
+			unsigned long long key = (entry.key << 2) | bit;
+			frontier.push(Entry{cell_distance(key, entry.level + 1), entry.level + 1, child, key});
+		}
+	}
+	return;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+void TST<DATA, T_RES, S2_RES>::add_count(int TIME_IDX, const int* spat_path, int delta) {
+	// Single writer: plain read-modify-write, published with relaxed stores for concurrent counters
+	auto bump = [delta](unsigned int& count) { __atomic_store_n(&count, count + delta, __ATOMIC_RELAXED); };
+	bump(temp_leaf[TIME_IDX].count);
+	for(int level = 0; level < s2_level; level++)
+		bump(spat_internal[spat_path[level]].count);
+	if(query_cache) query_cache->invalidate(temp_leaf[TIME_IDX].ENCODED_TIME);
+}
+
+template<class DATA, int T_RES, int S2_RES>
+int TST<DATA, T_RES, S2_RES>::trav_temp(unsigned int encoded_start_time) { // Traverse on Temporal Trie
+	// Every link is read once. A branch emptied by a concurrent Delete sends the reader back to the root.
+	// Pools never move, so their bases are kept in registers across the acquire loads.
+	const Node_T* T_INTER = temp_internal.data();
+	const Linked_Node* T_LEAF = temp_leaf.data();
+	while(true){
+		int i, bit = 0;
+		int u = ROOT_IDX;
+		if(load_link(T_INTER[ROOT_IDX].child[LEFT_CHILD]) == POINTER_NULL_INT &&
+			load_link(T_INTER[ROOT_IDX].child[RIGHT_CHILD]) == POINTER_NULL_INT)
+			return POINTER_NULL_INT; // Empty index
+
+		for(i = 1; i <= temp_len; i++){
+			bit = (encoded_start_time >> (temp_len-i)) & 1;
+			int child = load_link(T_INTER[u].child[bit]);
+			if(child == POINTER_NULL_INT) break;
+			u = child;
+		}
+		if(i == temp_len+1) return u;
+
+		for(; i <= temp_len && u != POINTER_NULL_INT; i++){
+			int right = load_link(T_INTER[u].child[RIGHT_CHILD]);
+			u = (right != POINTER_NULL_INT) ? right : load_link(T_INTER[u].child[LEFT_CHILD]);
+		}
+		if(u == POINTER_NULL_INT) continue;
+
+		// reach to the doubly linked list
+		int v = u;
+		while (v != POINTER_NULL_INT) {
+			if (T_LEAF[v].ENCODED_TIME > encoded_start_time) {
+				int closest = v, prev;
+				while ((prev = load_link(T_LEAF[v].prev)) != POINTER_NULL_INT && T_LEAF[prev].ENCODED_TIME > encoded_start_time) {
+					v = prev;
+					closest = v;
 				}
+				return closest;
+			}
+			else{
+				int next = load_link(T_LEAF[v].next);
+				if(next == POINTER_NULL_INT) break;
+				else v = next;
+			}
+		}
+		return v;
+	}
+}
 
-				// Update next node pointer
-				if (NEXT_IDX != POINTER_NULL_INT) {
-					spat_leaf[NEXT_IDX].prev = v;
+template<class DATA, int T_RES, int S2_RES>
+void TST<DATA, T_RES, S2_RES>::trav_spat(const Spatial_Plan& plan, int TIME_IDX, std::vector<DATA>& res) { // Traverse on Spatial Trie
+	const Data_Arena<DATA>& arena = data_arena;
+	trav_plan(plan, TIME_IDX, [](int) { return false; },
+		[&](const Data_Node<DATA>& leaf, const Spatial_Plan::Step&) { leaf.get_data(res, arena); return true; });
+}
+
+template<class DATA, int T_RES, int S2_RES>
+template<class ON_CELL, class ON_LEAF>
+bool TST<DATA, T_RES, S2_RES>::trav_plan(const Spatial_Plan& plan, int TIME_IDX, ON_CELL on_cell, ON_LEAF on_leaf) {
+	// The plan and the bin's subtrie are descended together: a shared prefix of the cells is walked once,
+	// and a branch missing from the subtrie drops every cell below it.
+	// on_cell(internal node) may answer a whole cell coarser than s2_level; otherwise on_leaf(leaf, plan step)
+	// sees each leaf in it and returns false to end the traversal.
+	const Linked_Node* T_LEAF = temp_leaf.data();
+	const Node_S* S_INTER = spat_internal.data();
+	const Data_Node<DATA>* S_LEAF = spat_leaf.data();
+	const int S2_LEVEL = s2_level; // Kept in a register across the acquire loads
+
+	std::pair<int, int> pending[4 * 31]; // (plan step, subtrie node); depth-first, at most 3 siblings per level wait
+	for(int lead_3bits = CHILD_ZERO; lead_3bits <= CHILD_SEVENTH; lead_3bits++){
+		if(plan.root(lead_3bits) == POINTER_NULL_INT) continue;
+		int u = load_link(T_LEAF[TIME_IDX].child[lead_3bits]);
+		if(u == POINTER_NULL_INT) continue; // NOT EXIST
+
+		int top = 0;
+		pending[top++] = std::make_pair(plan.root(lead_3bits), u);
+		while(top > 0){
+			const Spatial_Plan::Step& step = plan[pending[top - 1].first];
+			u = pending[--top].second;
+
+			if(!step.cell){
+				for(int bit = CHILD_THIRD; bit >= CHILD_ZERO; bit--){ // Pushed in reverse, so digits are visited in S2 order
+					if(step.child[bit] == POINTER_NULL_INT) continue;
+					int child = load_link(S_INTER[u].child[bit]);
+					if(child != POINTER_NULL_INT) pending[top++] = std::make_pair(step.child[bit], child);
 				}
-				break;
+				continue;
+			}
+
+			int level = step.level;
+			if(level == S2_LEVEL){ // Result Exist
+				if(!on_leaf(S_LEAF[u], step)) return false;
+				continue;
 			}
+			if(on_cell(u)) continue;
+			if(!trav_cell(u, level, step.s2, [&](const Data_Node<DATA>& leaf) { return on_leaf(leaf, step); })) return false;
 		}
 	}
+	return true;
+}
 
-	// Data Pointing (Insert into data vector)
-	spat_leaf[u].insert_data(data);
+template<class DATA, int T_RES, int S2_RES>
+template<class ON_LEAF>
+bool TST<DATA, T_RES, S2_RES>::trav_cell(int CELL_IDX, int level, unsigned long long s2, ON_LEAF on_leaf) {
+	// Every leaf below an internal node of a cell coarser than s2_level
+	const Node_S* S_INTER = spat_internal.data();
+	const Data_Node<DATA>* S_LEAF = spat_leaf.data();
+	const int SPAT_LEN = spat_len, S2_LEVEL = s2_level;
+
+	// Search the left most leaf node, restarting from the cell if a concurrent Delete empties the branch
+	int u = CELL_IDX, k;
+	for(k=1; k <= S2_LEVEL-level; k++){
+		int child = POINTER_NULL_INT;
+		for(int c = CHILD_ZERO; c <= CHILD_THIRD && child == POINTER_NULL_INT; c++)
+			child = load_link(S_INTER[u].child[c]);
+		if(child == POINTER_NULL_INT){
+			if(k == 1) break; // The cell itself is empty
+			u = CELL_IDX;
+			k = 0;
+			continue;
+		}
+		u = child;
+	}
+	if(k != S2_LEVEL-level+1) return true;
 
+	// The leaves below the cell are one run of the linked list: follow it while the key stays in the cell
+	int shift = SPAT_LEN - 3 - 2*level;
+	unsigned long long prefix = s2 >> shift;
+	unsigned int bin_time = S_LEAF[u].ENCODED_TIME;
+	for(int trav = u; trav != POINTER_NULL_INT; trav = load_link(S_LEAF[trav].next)){
+		if(S_LEAF[trav].ENCODED_TIME != bin_time || (S_LEAF[trav].S2_ID >> shift) != prefix) break;
+		if(!on_leaf(S_LEAF[trav])) return false;
+	}
+	return true;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+void TST<DATA, T_RES, S2_RES>::clear() {
+	if(wal) log_op(LOG_CLEAR, 0, 0, DATA());
+	reset();
+	if(wal) log_commit();
 	return;
 }
 
-template<class DATA>
-void TST<DATA>::Delete(unsigned int encoded_temp, unsigned long long encoded_spat, DATA data) {
+template<class DATA, int T_RES, int S2_RES>
+void TST<DATA, T_RES, S2_RES>::set_pool_reserve(size_t bytes) {
+	// The pools are mapped again with the new size, so nothing may be stored in them yet
+	check_writable();
+	if(spat_leaf.live() != 0){
+		throw std::logic_error("set_pool_reserve requires an empty index. Call clear() first.");
+	}
+	temp_internal.set_reserve(bytes);
+	temp_leaf.set_reserve(bytes);
+	spat_internal.set_reserve(bytes);
+	spat_leaf.set_reserve(bytes);
+	data_arena.set_reserve(bytes);
+	reset();
+	return;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+void TST<DATA, T_RES, S2_RES>::reset() {
+	// Release the node pools and the payload arena in bulk
+	temp_internal.clear();
+	temp_leaf.clear();
+	spat_internal.clear();
+	spat_leaf.clear();
+	data_arena.clear();
+	snapshot_map.reset();
+	if(query_cache) query_cache->clear();
+
+	temp_internal.allocate(); // Add ROOT Node
+	temp_leaf.reserve(1); // Map every pool now: readers cache the bases before the first insert
+	spat_internal.reserve(1);
+	spat_leaf.reserve(1);
+	data_arena.reserve(1);
+	PIVOT_IDX = POINTER_NULL_INT;
+	return;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+int TST<DATA, T_RES, S2_RES>::relocate_spat(int OLD_ROOT, Node_Pool<Node_S>& dst_internal, Node_Pool<Data_Node<DATA>>& dst_leaf,
+						std::vector<std::pair<int, int>>& moved_leaf, std::vector<int>& old_internal) {
+	// Copies a spatial subtrie in pre-order to the tail of the destination pools.
+	// Leaves are reported as (old, new) pairs in S2 order; linking is left to the caller.
+	int NEW_ROOT = POINTER_NULL_INT;
+	std::stack<std::tuple<int, int, int, int>> visit; // (old idx, new parent idx, child slot, level)
+	visit.push(std::make_tuple(OLD_ROOT, POINTER_NULL_INT, 0, 0));
+
+	while(!visit.empty()){
+		int OLD_IDX, PARENT_IDX, slot, level;
+		std::tie(OLD_IDX, PARENT_IDX, slot, level) = visit.top();
+		visit.pop();
+
+		int NEW_IDX;
+		if(level != s2_level){
+			Node_S node = spat_internal[OLD_IDX];
+			NEW_IDX = dst_internal.append();
+			dst_internal[NEW_IDX].count = node.count;
+			old_internal.push_back(OLD_IDX);
+			for(int bit = CHILD_THIRD; bit >= CHILD_ZERO; bit--){ // CHILD_ZERO is visited first
+				if(node.child[bit] != POINTER_NULL_INT)
+					visit.push(std::make_tuple(node.child[bit], NEW_IDX, bit, level + 1));
+			}
+		}
+		else{ // Leaf Node
+			Data_Node<DATA> node = spat_leaf[OLD_IDX];
+			NEW_IDX = dst_leaf.append();
+			dst_leaf[NEW_IDX] = node;
+			moved_leaf.push_back(std::make_pair(OLD_IDX, NEW_IDX));
+		}
+
+		if(PARENT_IDX == POINTER_NULL_INT) NEW_ROOT = NEW_IDX;
+		else dst_internal[PARENT_IDX].child[slot] = NEW_IDX;
+	}
+	return NEW_ROOT;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+void TST<DATA, T_RES, S2_RES>::compact() {
+	check_writable();
+	Node_Pool<Node_T> new_temp_internal(temp_internal.reserve_size());
+	Node_Pool<Linked_Node> new_temp_leaf(temp_leaf.reserve_size());
+	Node_Pool<Node_S> new_spat_internal(spat_internal.reserve_size());
+	Node_Pool<Data_Node<DATA>> new_spat_leaf(spat_leaf.reserve_size());
+	Data_Arena<DATA> new_data_arena(data_arena.reserve_size());
+
+	new_temp_internal.reserve(temp_internal.live());
+	new_temp_leaf.reserve(temp_leaf.live());
+	new_spat_internal.reserve(spat_internal.live());
+	new_spat_leaf.reserve(spat_leaf.live());
+	new_temp_internal.append(); // Add ROOT Node
+
+	std::vector<std::pair<int, int>> moved_leaf;
+	std::vector<int> old_internal;
+	moved_leaf.reserve(spat_leaf.live());
+
+	// 1 - Pre-order walk of the temporal trie; each time bin's spatial subtrie follows its leaf
+	std::stack<std::tuple<int, int, int, int>> visit; // (old idx, new parent idx, child bit, depth)
+	for(int bit = RIGHT_CHILD; bit >= LEFT_CHILD; bit--){
+		if(temp_internal[ROOT_IDX].child[bit] != POINTER_NULL_INT)
+			visit.push(std::make_tuple(temp_internal[ROOT_IDX].child[bit], ROOT_IDX, bit, 1));
+	}
+
+	while(!visit.empty()){
+		int OLD_IDX, PARENT_IDX, bit, depth;
+		std::tie(OLD_IDX, PARENT_IDX, bit, depth) = visit.top();
+		visit.pop();
+
+		int NEW_IDX;
+		if(depth != temp_len){
+			NEW_IDX = new_temp_internal.append();
+			for(int b = RIGHT_CHILD; b >= LEFT_CHILD; b--){
+				if(temp_internal[OLD_IDX].child[b] != POINTER_NULL_INT)
+					visit.push(std::make_tuple(temp_internal[OLD_IDX].child[b], NEW_IDX, b, depth + 1));
+			}
+		}
+		else{ // Temporal leaf: relocate its spatial subtrie right away
+			NEW_IDX = new_temp_leaf.append();
+			new_temp_leaf[NEW_IDX].ENCODED_TIME = temp_leaf[OLD_IDX].ENCODED_TIME;
+			new_temp_leaf[NEW_IDX].count = temp_leaf[OLD_IDX].count;
+			for(int lead_3bits = CHILD_ZERO; lead_3bits <= CHILD_SEVENTH; lead_3bits++){
+				int SPAT_ROOT = temp_leaf[OLD_IDX].child[lead_3bits];
+				if(SPAT_ROOT != POINTER_NULL_INT)
+					new_temp_leaf[NEW_IDX].child[lead_3bits] = relocate_spat(SPAT_ROOT, new_spat_internal, new_spat_leaf, moved_leaf, old_internal);
+			}
+		}
+		new_temp_internal[PARENT_IDX].child[bit] = NEW_IDX;
+	}
+
+	// 2 - Pre-order equals key order, so both linked lists become sequential
+	int n_temp_leaf = new_temp_leaf.size();
+	for(int i = 0; i < n_temp_leaf; i++){
+		new_temp_leaf[i].prev = (i > 0) ? i - 1 : POINTER_NULL_INT;
+		new_temp_leaf[i].next = (i + 1 < n_temp_leaf) ? i + 1 : POINTER_NULL_INT;
+	}
+
+	int n_spat_leaf = moved_leaf.size();
+	for(int i = 0; i < n_spat_leaf; i++){
+		new_spat_leaf[i].prev = (i > 0) ? i - 1 : POINTER_NULL_INT;
+		new_spat_leaf[i].next = (i + 1 < n_spat_leaf) ? i + 1 : POINTER_NULL_INT;
+		new_spat_leaf[i].move_payload(data_arena, new_data_arena); // Payload follows leaf order
+	}
+
+	temp_internal = std::move(new_temp_internal);
+	temp_leaf = std::move(new_temp_leaf);
+	spat_internal = std::move(new_spat_internal);
+	spat_leaf = std::move(new_spat_leaf);
+	data_arena = std::move(new_data_arena);
+	PIVOT_IDX = n_spat_leaf - 1;
+	return;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+void TST<DATA, T_RES, S2_RES>::compact(unsigned int encoded_time) {
+	check_writable();
 	int i, bit;
-	unsigned u = ROOT_IDX;
-	std::stack<unsigned> path_idx;
-	path_idx.push(ROOT_IDX);
+	int u = ROOT_IDX;
 
-	// 1 - Search for the existence of a path in the trie with a time prefix.
+	// 1 - Find the temporal leaf of the time bin
 	for(i = 1; i <= temp_len; i++){
-		bit = (encoded_temp >> (temp_len - i)) & 1;
+		bit = (encoded_time >> (temp_len - i)) & 1;
 		if(temp_internal[u].child[bit] == POINTER_NULL_INT){
-			std::cerr << "[Warning] Does not exist in the temporal trie. Deletion skipped." << std::endl;
+			std::cerr << "[Warning] Does not exist in the temporal trie. Compaction skipped." << std::endl;
 			return;
 		}
 		u = temp_internal[u].child[bit];
-		path_idx.push(u);
 	}
-	
 
-	// 2 - Search for the existence of a path in the trie with a space suffix.
-	// 2-1 - Check the leading 3 bits.
-	int lead_3bits = (encoded_spat >> (spat_len - 3)) & 0b111;
-	if(temp_leaf[u].child[lead_3bits] == POINTER_NULL_INT) {
-		std::cerr << "[Warning] Does not exist in the spatial trie. Deletion skipped." << std::endl;
-		return;
+	// 2 - Copy the spatial subtrie to the tail of the pools (not yet reachable)
+	std::vector<std::pair<int, int>> moved_leaf;
+	std::vector<int> old_internal;
+	int NEW_ROOT[CHILD_SEVENTH + 1];
+	for(int lead_3bits = CHILD_ZERO; lead_3bits <= CHILD_SEVENTH; lead_3bits++){
+		int SPAT_ROOT = temp_leaf[u].child[lead_3bits];
+		NEW_ROOT[lead_3bits] = (SPAT_ROOT != POINTER_NULL_INT) ?
+			relocate_spat(SPAT_ROOT, spat_internal, spat_leaf, moved_leaf, old_internal) : POINTER_NULL_INT;
 	}
-	u = temp_leaf[u].child[lead_3bits];
-	path_idx.push(u);
+	if(moved_leaf.empty()) return;
 
-	// 2-2 - Check in 2-bit increments
-	for(i = 1; i <= s2_level; i++){
-		bit = (encoded_spat >> (spat_len - 3 - 2*i)) & 0b11;
-		if(spat_internal[u].child[bit] == POINTER_NULL_INT){
-			std::cerr << "[Warning] Does not exist in the spatial trie. Deletion skipped." << std::endl;
-			return;
+	// 3 - The bin's leaves form one run of the linked list: chain the new run, then splice it in
+	int PREV_IDX = spat_leaf[moved_leaf.front().first].prev;
+	int NEXT_IDX = spat_leaf[moved_leaf.back().first].next;
+	for(size_t m = 0; m < moved_leaf.size(); m++){
+		int v = moved_leaf[m].second;
+		spat_leaf[v].prev = (m > 0) ? moved_leaf[m - 1].second : PREV_IDX;
+		spat_leaf[v].next = (m + 1 < moved_leaf.size()) ? moved_leaf[m + 1].second : NEXT_IDX;
+		if(moved_leaf[m].first == PIVOT_IDX) PIVOT_IDX = v;
+	}
+	if(PREV_IDX != POINTER_NULL_INT) publish_link(spat_leaf[PREV_IDX].next, moved_leaf.front().second);
+	if(NEXT_IDX != POINTER_NULL_INT) publish_link(spat_leaf[NEXT_IDX].prev, moved_leaf.back().second);
+	for(int lead_3bits = CHILD_ZERO; lead_3bits <= CHILD_SEVENTH; lead_3bits++){
+		if(NEW_ROOT[lead_3bits] != POINTER_NULL_INT)
+			publish_link(temp_leaf[u].child[lead_3bits], NEW_ROOT[lead_3bits]);
+	}
+
+	// 4 - Hand the old slots to the free lists (payload chunks now belong to the new leaves)
+	for(const auto& MOVED : moved_leaf) spat_leaf.release(MOVED.first);
+	for(int OLD_IDX : old_internal) spat_internal.release(OLD_IDX);
+	retire();
+	return;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+Snapshot_Header TST<DATA, T_RES, S2_RES>::snapshot_header() const {
+	Snapshot_Header header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+	header.version = SNAPSHOT_VERSION;
+	header.slot_size[SNAP_TEMP_INTER] = sizeof(Node_T);
+	header.slot_size[SNAP_TEMP_LEAF] = sizeof(Linked_Node);
+	header.slot_size[SNAP_SPAT_INTER] = sizeof(Node_S);
+	header.slot_size[SNAP_SPAT_LEAF] = sizeof(Data_Node<DATA>);
+	header.slot_size[SNAP_DATA_CHUNK] = sizeof(Data_Chunk<DATA>);
+	header.temp_len = temp_len;
+	header.spat_len = spat_len;
+	header.s2_level = s2_level;
+	header.max_cell = MAXCELL;
+	header.pivot_idx = PIVOT_IDX;
+	header.data_inline_size = DATA_INLINE_SIZE;
+	header.data_chunk_size = DATA_CHUNK_SIZE;
+	header.log_seq = LOG_SEQ;
+
+	header.pool_size[SNAP_TEMP_INTER] = temp_internal.size();
+	header.pool_size[SNAP_TEMP_LEAF] = temp_leaf.size();
+	header.pool_size[SNAP_SPAT_INTER] = spat_internal.size();
+	header.pool_size[SNAP_SPAT_LEAF] = spat_leaf.size();
+	header.pool_size[SNAP_DATA_CHUNK] = data_arena.size();
+	header.free_head[SNAP_TEMP_INTER] = temp_internal.saved_free_head();
+	header.free_head[SNAP_TEMP_LEAF] = temp_leaf.saved_free_head();
+	header.free_head[SNAP_SPAT_INTER] = spat_internal.saved_free_head();
+	header.free_head[SNAP_SPAT_LEAF] = spat_leaf.saved_free_head();
+	header.free_head[SNAP_DATA_CHUNK] = data_arena.saved_free_head();
+	header.dead[SNAP_TEMP_INTER] = temp_internal.saved_dead();
+	header.dead[SNAP_TEMP_LEAF] = temp_leaf.saved_dead();
+	header.dead[SNAP_SPAT_INTER] = spat_internal.saved_dead();
+	header.dead[SNAP_SPAT_LEAF] = spat_leaf.saved_dead();
+	header.dead[SNAP_DATA_CHUNK] = data_arena.saved_dead();
+
+	uint64_t cursor = sizeof(Snapshot_Header);
+	for(int k = 0; k < SNAP_POOLS; k++){
+		cursor = (cursor + SNAPSHOT_ALIGN - 1) / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN;
+		header.offset[k] = cursor;
+		cursor += header.pool_size[k] * header.slot_size[k];
+	}
+	return header;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+template<class WRITE>
+void TST<DATA, T_RES, S2_RES>::write_snapshot(const Snapshot_Header& header, WRITE write) const {
+	// write(offset, source, length) is called in increasing offset order; the gaps are alignment padding
+	write(0, &header, sizeof(header));
+	temp_internal.write_slots(header.offset[SNAP_TEMP_INTER], write);
+	temp_leaf.write_slots(header.offset[SNAP_TEMP_LEAF], write);
+	spat_internal.write_slots(header.offset[SNAP_SPAT_INTER], write);
+	spat_leaf.write_slots(header.offset[SNAP_SPAT_LEAF], write);
+	data_arena.write_slots(header.offset[SNAP_DATA_CHUNK], write);
+}
+
+template<class DATA, int T_RES, int S2_RES>
+std::vector<char> TST<DATA, T_RES, S2_RES>::snapshot_image() const {
+	// The bytes save() would write, copied in memory
+	Snapshot_Header header = snapshot_header();
+	uint64_t length = sizeof(header);
+	for(int k = 0; k < SNAP_POOLS; k++) length = std::max(length, header.offset[k] + header.pool_size[k] * header.slot_size[k]);
+	std::vector<char> image(length);
+	write_snapshot(header, [&](uint64_t offset, const void* src, uint64_t bytes) {
+		if(bytes != 0) std::memcpy(image.data() + offset, src, bytes);
+	});
+	return image;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+void TST<DATA, T_RES, S2_RES>::save(const std::string& path) const {
+	static_assert(std::is_trivially_copyable<DATA>::value, "Snapshots require a trivially copyable DATA type.");
+	Snapshot_Header header = snapshot_header();
+
+	// Write to a temporary file first, so an existing snapshot is only replaced by a complete one
+	std::string tmp_path = path + ".tmp";
+	std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+	if(!out){
+		throw std::runtime_error("Cannot create snapshot file: " + tmp_path);
+	}
+
+	const char zeros[SNAPSHOT_ALIGN] = {};
+	write_snapshot(header, [&](uint64_t offset, const void* src, uint64_t bytes) {
+		out.write(zeros, offset - out.tellp()); // Alignment padding
+		out.write(static_cast<const char*>(src), bytes);
+	});
+
+	out.close();
+	if(!out || std::rename(tmp_path.c_str(), path.c_str()) != 0){
+		std::remove(tmp_path.c_str());
+		throw std::runtime_error("Failed to write snapshot file: " + path);
+	}
+	return;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+void TST<DATA, T_RES, S2_RES>::load_snapshot(const std::string& path) {
+	Snapshot_Map file(path);
+	attach_snapshot(file.data(), file.size(), true);
+	return;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+void TST<DATA, T_RES, S2_RES>::open_snapshot(const std::string& path) {
+	std::unique_ptr<Snapshot_Map> file(new Snapshot_Map(path));
+	attach_snapshot(file->data(), file->size(), false);
+	snapshot_map = std::move(file);
+	return;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+void TST<DATA, T_RES, S2_RES>::attach_snapshot(const char* file, size_t length, bool copy) {
+	static_assert(std::is_trivially_copyable<DATA>::value, "Snapshots require a trivially copyable DATA type.");
+
+	// 1 - Validate the header against this build and the file length
+	Snapshot_Header header;
+	std::memcpy(&header, file, sizeof(header));
+	if(std::memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0){
+		throw std::runtime_error("Not a TST snapshot file.");
+	}
+	if(header.version != SNAPSHOT_VERSION){
+		throw std::runtime_error("Unsupported snapshot version " + std::to_string(header.version) + ".");
+	}
+	if(header.slot_size[SNAP_TEMP_INTER] != sizeof(Node_T) || header.slot_size[SNAP_TEMP_LEAF] != sizeof(Linked_Node) ||
+		header.slot_size[SNAP_SPAT_INTER] != sizeof(Node_S) || header.slot_size[SNAP_SPAT_LEAF] != sizeof(Data_Node<DATA>) ||
+		header.slot_size[SNAP_DATA_CHUNK] != sizeof(Data_Chunk<DATA>) ||
+		header.data_inline_size != DATA_INLINE_SIZE || header.data_chunk_size != DATA_CHUNK_SIZE){
+		throw std::runtime_error("Snapshot node layout does not match this build (DATA type or payload sizes differ).");
+	}
+	if(header.s2_level < 1 || header.s2_level > 30 || header.spat_len != header.s2_level * 2 + 4 ||
+		header.temp_len < 6 || header.temp_len > 32 || header.pool_size[SNAP_TEMP_INTER] == 0){
+		throw std::runtime_error("Snapshot header is corrupted.");
+	}
+	for(int k = 0; k < SNAP_POOLS; k++){
+		if(header.offset[k] % SNAPSHOT_ALIGN != 0 || header.offset[k] > length ||
+			header.pool_size[k] * header.slot_size[k] > length - header.offset[k]){
+			throw std::runtime_error("Snapshot file is truncated.");
 		}
-		u = spat_internal[u].child[bit];
-		path_idx.push(u);
 	}
 
-	/* 3 -  Delete the actual data referenced by the node. */ 
-	auto& vec = *(spat_leaf[u].data_vector_ptr);
-	auto it = std::find(vec.begin(), vec.end(), data);
-	if(it != vec.end()){
-		vec.erase(it);
+	if((S2_RES && header.s2_level != S2_RES) || (T_RES && header.temp_len != T_RES)){
+		throw std::runtime_error("Snapshot resolution does not match the one this TST is compiled for.");
+	}
+
+	// 2 - Point (or copy) every pool at its section of the file
+	reset();
+	temp_len = header.temp_len;
+	spat_len = header.spat_len;
+	s2_level = header.s2_level;
+	total_len = temp_len + spat_len;
+	MAXCELL = header.max_cell;
+	PIVOT_IDX = header.pivot_idx;
+	LOG_SEQ = header.log_seq;
+
+	Node_T* temp_internal_ptr = (Node_T*)(file + header.offset[SNAP_TEMP_INTER]);
+	Linked_Node* temp_leaf_ptr = (Linked_Node*)(file + header.offset[SNAP_TEMP_LEAF]);
+	Node_S* spat_internal_ptr = (Node_S*)(file + header.offset[SNAP_SPAT_INTER]);
+	Data_Node<DATA>* spat_leaf_ptr = (Data_Node<DATA>*)(file + header.offset[SNAP_SPAT_LEAF]);
+	Data_Chunk<DATA>* data_chunk_ptr = (Data_Chunk<DATA>*)(file + header.offset[SNAP_DATA_CHUNK]);
+
+	if(copy){
+		temp_internal.assign(temp_internal_ptr, header.pool_size[SNAP_TEMP_INTER], header.free_head[SNAP_TEMP_INTER], header.dead[SNAP_TEMP_INTER]);
+		temp_leaf.assign(temp_leaf_ptr, header.pool_size[SNAP_TEMP_LEAF], header.free_head[SNAP_TEMP_LEAF], header.dead[SNAP_TEMP_LEAF]);
+		spat_internal.assign(spat_internal_ptr, header.pool_size[SNAP_SPAT_INTER], header.free_head[SNAP_SPAT_INTER], header.dead[SNAP_SPAT_INTER]);
+		spat_leaf.assign(spat_leaf_ptr, header.pool_size[SNAP_SPAT_LEAF], header.free_head[SNAP_SPAT_LEAF], header.dead[SNAP_SPAT_LEAF]);
+		data_arena.assign(data_chunk_ptr, header.pool_size[SNAP_DATA_CHUNK], header.free_head[SNAP_DATA_CHUNK], header.dead[SNAP_DATA_CHUNK]);
+	}
+	else{ // Zero-copy: the pages stay read-only, so mutators are rejected by check_writable()
+		temp_internal.view(temp_internal_ptr, header.pool_size[SNAP_TEMP_INTER], header.free_head[SNAP_TEMP_INTER], header.dead[SNAP_TEMP_INTER]);
+		temp_leaf.view(temp_leaf_ptr, header.pool_size[SNAP_TEMP_LEAF], header.free_head[SNAP_TEMP_LEAF], header.dead[SNAP_TEMP_LEAF]);
+		spat_internal.view(spat_internal_ptr, header.pool_size[SNAP_SPAT_INTER], header.free_head[SNAP_SPAT_INTER], header.dead[SNAP_SPAT_INTER]);
+		spat_leaf.view(spat_leaf_ptr, header.pool_size[SNAP_SPAT_LEAF], header.free_head[SNAP_SPAT_LEAF], header.dead[SNAP_SPAT_LEAF]);
+		data_arena.view(data_chunk_ptr, header.pool_size[SNAP_DATA_CHUNK], header.free_head[SNAP_DATA_CHUNK], header.dead[SNAP_DATA_CHUNK]);
+	}
+	return;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+bool TST<DATA, T_RES, S2_RES>::is_read_only() const {
+	return snapshot_map != nullptr;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+void TST<DATA, T_RES, S2_RES>::check_writable() const {
+	if(snapshot_map){
+		throw std::logic_error("The index is mapped read-only from a snapshot. Use load_snapshot() (or clear()) before modifying it.");
+	}
+}
+
+template<class DATA, int T_RES, int S2_RES>
+void TST<DATA, T_RES, S2_RES>::check_plan(const Spatial_Plan& plan) const {
+	if(!plan.empty() && plan.getSpat_len() != spat_len){
+		throw std::invalid_argument("The query plan was compiled for an index with another S2 level.");
+	}
+}
+
+template<class DATA, int T_RES, int S2_RES>
+void TST<DATA, T_RES, S2_RES>::enable_cache(size_t capacity) {
+	query_cache.reset(new Query_Cache<DATA>(capacity));
+	return;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+void TST<DATA, T_RES, S2_RES>::disable_cache() {
+	query_cache.reset();
+	return;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+size_t TST<DATA, T_RES, S2_RES>::getCache_Hits() const {
+	return query_cache ? query_cache->hit_count() : 0;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+size_t TST<DATA, T_RES, S2_RES>::getCache_Misses() const {
+	return query_cache ? query_cache->miss_count() : 0;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+void TST<DATA, T_RES, S2_RES>::enable_log(const std::string& path, const Log_Options& options) {
+	check_writable();
+	wal.reset(); // Close a previous log first
+	wal.reset(new Write_Ahead_Log<DATA>(path, options));
+	log_options = options;
+	LOG_SINCE_CHECKPOINT = 0;
+	return;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+void TST<DATA, T_RES, S2_RES>::disable_log() {
+	wal.reset(); // The destructor writes and syncs the remaining records
+	return;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+void TST<DATA, T_RES, S2_RES>::flush_log() {
+	if(wal) wal->flush();
+	return;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+void TST<DATA, T_RES, S2_RES>::log_op(int op, unsigned int encoded_temp, unsigned long long encoded_spat, const DATA& data) {
+	// Runs before the operation is applied: if the record cannot be logged, the index is left unchanged.
+	// Only trivially copyable DATA can be logged (enable_log), so no other DATA instantiates the log.
+	if constexpr (std::is_trivially_copyable<DATA>::value){
+		wal->append(LOG_SEQ + 1, op, encoded_temp, encoded_spat, data);
+		LOG_SEQ++;
+		LOG_SINCE_CHECKPOINT++;
+	}
+}
+
+template<class DATA, int T_RES, int S2_RES>
+void TST<DATA, T_RES, S2_RES>::log_commit() {
+	// Runs once the logged operation is applied, so the checkpoint contains it. Only the copy of the pools
+	// happens here; the log's saver thread writes and syncs the snapshot, then trims the log.
+	if constexpr (std::is_trivially_copyable<DATA>::value){
+		if(log_options.checkpoint_records != 0 && LOG_SINCE_CHECKPOINT >= log_options.checkpoint_records &&
+			!log_options.checkpoint_path.empty() && !wal->checkpoint_pending()){
+			wal->checkpoint_async(log_options.checkpoint_path, snapshot_image(), LOG_SEQ);
+			LOG_SINCE_CHECKPOINT = 0;
+		}
+	}
+}
+
+template<class DATA, int T_RES, int S2_RES>
+void TST<DATA, T_RES, S2_RES>::checkpoint(const std::string& path) {
+	// 0 - An automatic checkpoint still being saved must not replace this newer one afterwards
+	if(wal) wal->wait_checkpoint();
+
+	// 1 - The snapshot records LOG_SEQ, so a crash before step 3 only replays records it already contains as no-ops
+	save(path);
+
+	// 2 - Make the snapshot durable before the log records it replaces are dropped
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if(fd < 0 || fsync(fd) != 0){
+		if(fd >= 0) ::close(fd);
+		throw std::runtime_error("Cannot sync snapshot file: " + path);
+	}
+	::close(fd);
+
+	// 3 - Drop the records the snapshot contains
+	if(wal) wal->discard_through(LOG_SEQ);
+	LOG_SINCE_CHECKPOINT = 0;
+	return;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+void TST<DATA, T_RES, S2_RES>::recover(const std::string& snapshot_path, const std::string& log_path) {
+	// Replayed operations must not be logged again
+	std::unique_ptr<Write_Ahead_Log<DATA>> active_log = std::move(wal);
+	if(active_log){
+		active_log->wait_checkpoint(); // The saver thread may be replacing the snapshot or the log
+		active_log->flush();
+	}
+
+	// 1 - Start from the latest checkpoint, if there is one
+	if(access(snapshot_path.c_str(), F_OK) == 0){
+		load_snapshot(snapshot_path);
 	}
 	else{
-		std::cerr << "[Warning] Leaf node does not reference a valid data. "
-          			<< "Possible missing or null data. Deletion skipped." << std::endl;
-		return;
+		reset();
+		LOG_SEQ = 0;
 	}
 
-	// Idx Checker
-	if(u != path_idx.top()){
-		std::cerr << "[Warning] The final index does not match." << std::endl;
+	// 2 - Replay the records written after the checkpoint
+	size_t valid = Write_Ahead_Log<DATA>::replay(log_path,
+		[&](uint64_t seq, int op, unsigned int encoded_temp, unsigned long long encoded_spat, const DATA& data) {
+			if(seq <= LOG_SEQ) return; // Already contained in the snapshot
+			switch(op){
+				case LOG_INSERT: Insert(encoded_temp, encoded_spat, data); break;
+				case LOG_DELETE: remove_data(encoded_temp, encoded_spat, data); break;
+				case LOG_CLEAR: reset(); break;
+			}
+			LOG_SEQ = seq;
+		});
+	retire();
+
+	// 3 - Cut a torn tail, so records appended from now on follow the last intact one
+	struct stat st;
+	if(valid > 0 && stat(log_path.c_str(), &st) == 0 && (size_t)st.st_size > valid){
+		if(::truncate(log_path.c_str(), valid) != 0){
+			throw std::runtime_error("Cannot truncate log file: " + log_path);
+		}
 	}
-	path_idx.pop();
 
-	// 3-1 - Disable the spatial leaf node
-	if(vec.empty()){
-		int PREV_IDX = spat_leaf[u].prev;
-		int NEXT_IDX = spat_leaf[u].next;
+	wal = std::move(active_log);
+	return;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+void TST<DATA, T_RES, S2_RES>::retire() {
+	// Slots released during this operation are recycled once every reader that
+	// entered before their unlinking has left
+	uint64_t epoch = epochs->advance();
+	temp_internal.seal(epoch);
+	temp_leaf.seal(epoch);
+	spat_internal.seal(epoch);
+	spat_leaf.seal(epoch);
+	data_arena.seal(epoch);
+
+	uint64_t safe_epoch = epochs->oldest();
+	temp_internal.reclaim(safe_epoch);
+	temp_leaf.reclaim(safe_epoch);
+	spat_internal.reclaim(safe_epoch);
+	spat_leaf.reclaim(safe_epoch);
+	data_arena.reclaim(safe_epoch);
+}
+
+template<class DATA, int T_RES, int S2_RES>
+void TST<DATA, T_RES, S2_RES>::setMaxCells(int new_max) {
+	// You can set the maximum number of S2 cells to search within the queried spatial range.
+	MAXCELL = new_max;
+	return;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+int TST<DATA, T_RES, S2_RES>::getInter_NodeCount() const {
+	return temp_internal.live() + temp_leaf.live() + spat_internal.live();
+}
+
+template<class DATA, int T_RES, int S2_RES>
+int TST<DATA, T_RES, S2_RES>::getLeaf_NodeCount() const {
+	return spat_leaf.live();
+}
+
+template<class DATA, int T_RES, int S2_RES>
+int TST<DATA, T_RES, S2_RES>::getTotal_NodeCount() const {
+	return getInter_NodeCount() + getLeaf_NodeCount();
+}
+
+template<class DATA, int T_RES, int S2_RES>
+int TST<DATA, T_RES, S2_RES>::get_DataCount() const {
+	int total_size = 0;
+    for(unsigned i = 0; i < spat_leaf.size(); i++){
+        total_size += spat_leaf[i].size();
+    }
+	return total_size;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+double TST<DATA, T_RES, S2_RES>::get_size() const {
+    size_t temp_internal_bytes = temp_internal.size() * sizeof(Node_T);
+    size_t temp_leaf_bytes     = temp_leaf.size() * sizeof(Linked_Node);
+    size_t spat_internal_bytes = spat_internal.size() * sizeof(Node_S);
+    size_t spat_leaf_bytes     = spat_leaf.size() * sizeof(Data_Node<DATA>);
+    size_t data_arena_bytes    = data_arena.get_bytes();
+
+    size_t total_bytes = temp_internal_bytes + temp_leaf_bytes + 
+                         spat_internal_bytes + spat_leaf_bytes + data_arena_bytes;
+
+    return total_bytes / (1024.0 * 1024.0);  // Convert to MB
+}
+
+template<class DATA, int T_RES, int S2_RES>
+double TST<DATA, T_RES, S2_RES>::get_payload_size() const {
+	return data_arena.get_bytes() / (1024.0 * 1024.0);  // Convert to MB
+}
+
+template<class DATA, int T_RES, int S2_RES>
+int TST<DATA, T_RES, S2_RES>::getTemp_len() const {
+	return temp_len;
+}
+
+template<class DATA, int T_RES, int S2_RES>
+int TST<DATA, T_RES, S2_RES>::getSpat_len() const {
+	return spat_len;
+}
 
-		// Detach target node from the doubly linked list
-		spat_leaf[u].prev = POINTER_NULL_INT;
-		spat_leaf[u].next = POINTER_NULL_INT;
+template<class DATA, int T_RES, int S2_RES>
+int TST<DATA, T_RES, S2_RES>::getTotal_len() const {
+	return total_len;
+}
 
-		// Spatial Trie Leaf Node
-		switch (spat_leaf.size() - D_SPAT_LEAF) {
-			case 1:
-				D_SPAT_LEAF++;
-				break; // ROOT Free
-			case 2: {
-				D_SPAT_LEAF++;
-				unsigned other = (PREV_IDX != POINTER_NULL_INT) ? PREV_IDX : NEXT_IDX;
-				spat_leaf[other].prev = POINTER_NULL_INT;
-            	spat_leaf[other].next = POINTER_NULL_INT;
-				break;
-			}
-			default: {
-				D_SPAT_LEAF++;
-				if(PREV_IDX != POINTER_NULL_INT)
-					spat_leaf[PREV_IDX].next = NEXT_IDX;
-				if(NEXT_IDX != POINTER_NULL_INT)
-					spat_leaf[NEXT_IDX].prev = PREV_IDX;
-				break;
-			}
-		}
-	}
-	else // Do not need to deactivate the node
-		return;
+/* Sharded Tree */
+enum {SHARD_BY_TIME, SHARD_BY_SPACE}; // Which key prefix picks the shard
 
+template<class DATA>
+class Sharded_TST { // Independent TSTs behind one lock each; records are routed by a hashed key prefix
+private:
+	int n_shards;
+	int mode;
+	int prefix_bits; // Leading bits of the routed key that select the shard
+	TST<DATA> codec; // Empty tree with the same resolution, only used for encoding and S2 coverings
+	std::vector<std::unique_ptr<TST<DATA>>> shards;
+	std::unique_ptr<std::mutex[]> locks;
 
-	// 3-2 - Check whether the spatial internal node (2-bits) should be disabled
-	u = path_idx.top();
-	for(i = s2_level; i >= 1; i--){
-		bit = (encoded_spat >> (spat_len - 3 - 2*i)) & 0b11;
-		spat_internal[u].child[bit] = POINTER_NULL_INT;
+	int shard_of(unsigned int, unsigned long long) const;
+	template<class FN>
+	bool for_each_block(unsigned int, unsigned int, FN); // SHARD_BY_TIME: fn(shard, start, end) on runs of bins, in time order
 
-		for(int j = CHILD_ZERO; j <= CHILD_THIRD; j++){
-			if(spat_internal[u].child[j] != POINTER_NULL_INT)
-				return; // There are child nodes more than one 
-		}
-		D_INTER++;
+public:
+	typedef typename TST<DATA>::Record Record;
 
-		// If there is no more child node, then deactivate
-		path_idx.pop();
-		u = path_idx.top();
-	}
+	Sharded_TST(int, const std::string&, int, int = SHARD_BY_SPACE, int = 0);
 
-	// 3-3 - Check whether the temporal leaf node should be disabled
-	temp_leaf[u].child[lead_3bits] = POINTER_NULL_INT;
-	for(int j = CHILD_ZERO; j <= CHILD_SEVENTH; j++){
-		if(temp_leaf[u].child[j] != POINTER_NULL_INT)
-			return;
-	}
+	template<typename... Args>
+	unsigned int time_encoder(Args...);
+	unsigned long long space_encoder(double, double);
+	void time_encoder_batch(size_t, const int* const*, unsigned int*);
+	void space_encoder_batch(size_t, const double*, const double*, unsigned long long*);
+	void Insert(unsigned int, unsigned long long, DATA); // Safe to call from any number of threads
+	void Delete(unsigned int, unsigned long long, DATA);
+	void InsertBatch(std::vector<Record>&); // Partitions the batch and inserts every shard's part in parallel
 
-	// Detach temporal leaf node from the doubly linked list
-	int PREV_IDX = temp_leaf[u].prev;
-	int NEXT_IDX = temp_leaf[u].next;
-	temp_leaf[u].prev = POINTER_NULL_INT;
-	temp_leaf[u].next = POINTER_NULL_INT;
+	Spatial_Plan REC_S2_FINDER(std::vector<double>&, std::vector<double>&);
+	Spatial_Plan REGION_S2_FINDER(const S2Region&);
+	void range_search(const Spatial_Plan&, unsigned int, unsigned int, std::vector<DATA>& res);
+	size_t range_count(const Spatial_Plan&, unsigned int, unsigned int);
+	void knn_search(double, double, size_t, unsigned int, unsigned int, std::vector<std::pair<DATA, S1Angle>>& res);
+	template<class FN>
+	bool range_visit(const Spatial_Plan&, unsigned int, unsigned int, FN); // Same order as range_search
+	void range_search(const std::map<int, std::vector<unsigned long long>>&,
+									unsigned int, unsigned int, std::vector<DATA>& res);
 
-	switch (temp_leaf.size() - D_TEMP_LEAF) {
-		case 1:
-			D_TEMP_LEAF++;
-			break; // ROOT Free
-		case 2: {
-			D_TEMP_LEAF++;
-			unsigned other = (PREV_IDX != POINTER_NULL_INT) ? PREV_IDX : NEXT_IDX;
-			temp_leaf[other].prev = POINTER_NULL_INT;
-			temp_leaf[other].next = POINTER_NULL_INT;
-			break;
-		}
-		default: {
-			D_TEMP_LEAF++;
-			if(PREV_IDX != POINTER_NULL_INT)
-				temp_leaf[PREV_IDX].next = NEXT_IDX;
-			if(NEXT_IDX != POINTER_NULL_INT)
-				temp_leaf[NEXT_IDX].prev = PREV_IDX;
-			break;
-		}
+	void setMaxCells(int);
+	int shard_count() const; // Getter for # of shards
+	TST<DATA>& shard(int); // Direct access; the caller must not race with Insert/Delete
+	int get_DataCount(); // Getter for Total Data Count
+	double get_size(); // Getter for Index size
+};
+
+template<class DATA>
+Sharded_TST<DATA>::Sharded_TST(int s2_res, const std::string& t_res, int n, int shard_mode, int bits)
+	: n_shards(n), mode(shard_mode), codec(s2_res, t_res), locks(new std::mutex[n > 0 ? n : 1]) {
+	if(n_shards < 1){
+		throw std::invalid_argument("Sharded_TST needs at least one shard.");
+	}
+	if(mode != SHARD_BY_TIME && mode != SHARD_BY_SPACE){
+		throw std::invalid_argument("Unknown shard mode. Use SHARD_BY_TIME or SHARD_BY_SPACE.");
 	}
 
-	// 3-4 - Check whether the temporal internal node (1-bit) should be disabled
-	D_INTER--; // prevent duplicate calculation (D_TEMP_LEAF)
-	for(i = temp_len; i >= 1; i--){
-		path_idx.pop();
-		u = path_idx.top();
+	// Default prefix: a whole time bin, or the S2 cell at level 16 (about 150m) including the face
+	int key_len = (mode == SHARD_BY_TIME) ? codec.getTemp_len() : codec.getSpat_len();
+	if(bits <= 0)
+		bits = (mode == SHARD_BY_TIME) ? key_len : std::min(key_len, 3 + 2 * 16);
+	prefix_bits = std::min(bits, key_len);
 
-		bit = (encoded_temp >> (temp_len - i)) & 1;
-		temp_internal[u].child[bit] = POINTER_NULL_INT;
-		
-		if(temp_internal[u].child[1-bit] != POINTER_NULL_INT)
-			return;
-		D_INTER++;
+	for(int k = 0; k < n_shards; k++){
+		shards.emplace_back(new TST<DATA>(s2_res, t_res));
 	}
+}
 
-	return;
+template<class DATA>
+int Sharded_TST<DATA>::shard_of(unsigned int encoded_temp, unsigned long long encoded_spat) const {
+	unsigned long long prefix = (mode == SHARD_BY_TIME) ?
+		(unsigned long long)encoded_temp >> (codec.getTemp_len() - prefix_bits) :
+		encoded_spat >> (codec.getSpat_len() - prefix_bits);
+
+	// Neighbouring prefixes (adjacent cells, consecutive time bins) land on different shards
+	unsigned long long h = prefix * 0x9E3779B97F4A7C15ULL;
+	return (int)((h >> 32) % (unsigned long long)n_shards);
 }
 
 template<class DATA>
-std::map<int, std::vector<unsigned long long>> TST<DATA>::REC_S2_FINDER(std::vector<double>& left_bottom, std::vector<double>& right_upper) {
-	S2RegionCoverer::Options options;
-	options.set_max_level(s2_level);
-	options.set_max_cells(MAXCELL);
-	S2RegionCoverer coverer(options);
+template<class FN>
+bool Sharded_TST<DATA>::for_each_block(unsigned int encoded_start_time, unsigned int encoded_end_time, FN fn) {
+	// Consecutive bins sharing a prefix live on one shard; the shard holding the earliest pending bin goes next
+	const unsigned long long NONE = ~0ULL, block = 1ULL << (codec.getTemp_len() - prefix_bits);
+	std::vector<unsigned long long> next(n_shards);
+	auto seek = [&](int k, unsigned long long from) {
+		unsigned int bin;
+		next[k] = (from < encoded_end_time && shards[k]->next_bin((unsigned int)from, bin) && bin < encoded_end_time) ? bin : NONE;
+	};
+	for(int k = 0; k < n_shards; k++) seek(k, encoded_start_time);
 
-	S2LatLngRect rect = S2LatLngRect::FromPointPair(S2LatLng::FromDegrees(left_bottom[0], left_bottom[1]), S2LatLng::FromDegrees(right_upper[0], right_upper[1]));
-	S2CellUnion covering = coverer.GetCovering(rect);
+	while(true){
+		int k = std::min_element(next.begin(), next.end()) - next.begin();
+		if(next[k] == NONE) return true;
+		unsigned long long block_end = std::min<unsigned long long>((next[k] / block + 1) * block, encoded_end_time);
+		if(!fn(k, (unsigned int)next[k], (unsigned int)block_end)) return false;
+		seek(k, block_end);
+	}
+}
 
-	/* Identify the S2 Cells within the queried space */
-	unsigned long long number_of_cells = covering.size();
-	std::map<int, std::vector<unsigned long long>> levelMap; // S2 Cell level map
+template<class DATA>
+template<typename... Args>
+unsigned int Sharded_TST<DATA>::time_encoder(Args... args) {
+	return codec.time_encoder(args...);
+}
 
-	for(unsigned long long i = 0; i < number_of_cells; i++){
-		unsigned long long s2_search_id = covering.cell_id(i).id();
-		int level = covering.cell_id(i).level();
+template<class DATA>
+unsigned long long Sharded_TST<DATA>::space_encoder(double lat, double lon) {
+	return codec.space_encoder(lat, lon);
+}
 
-		if (levelMap.find(level) == levelMap.end()) {
-			levelMap[level] = std::vector<unsigned long long>{s2_search_id};
-		} else {
-			levelMap[level].push_back(s2_search_id);
-		}
-	}
-	
-	return levelMap;
+template<class DATA>
+void Sharded_TST<DATA>::time_encoder_batch(size_t n, const int* const* fields, unsigned int* out) {
+	codec.time_encoder_batch(n, fields, out);
 }
 
 template<class DATA>
-void TST<DATA>::range_search(std::map<int, std::vector<unsigned long long>>& S2_LEVEL_MAP, 
-									unsigned int encoded_start_time, unsigned int encoded_end_time, std::vector<DATA>& res) {
-	// Finds the time node closest to the starting point
-	int TIME_IDX = trav_temp(encoded_start_time);
-	while(TIME_IDX != POINTER_NULL_INT && temp_leaf[TIME_IDX].ENCODED_TIME < encoded_end_time){
-		trav_spat(S2_LEVEL_MAP, TIME_IDX, res);
-		TIME_IDX = temp_leaf[TIME_IDX].next;
-	}
-	return;
+void Sharded_TST<DATA>::space_encoder_batch(size_t n, const double* lat, const double* lon, unsigned long long* out) {
+	codec.space_encoder_batch(n, lat, lon, out);
 }
 
 template<class DATA>
-int TST<DATA>::trav_temp(unsigned int encoded_start_time) { // Traverse on Temporal Trie
-	int i, bit = 0;
-	int u = ROOT_IDX;
+void Sharded_TST<DATA>::Insert(unsigned int encoded_temp, unsigned long long encoded_spat, DATA data) {
+	int k = shard_of(encoded_temp, encoded_spat);
+	std::lock_guard<std::mutex> guard(locks[k]);
+	shards[k]->Insert(encoded_temp, encoded_spat, data);
+	return;
+}
 
-	for(i = 1; i <= temp_len; i++){
-		bit = (encoded_start_time >> (temp_len-i)) & 1;
-		if(temp_internal[u].child[bit] == POINTER_NULL_INT) break;
-		u = temp_internal[u].child[bit];
-	}
-	if(i == temp_len+1) return u;
+template<class DATA>
+void Sharded_TST<DATA>::Delete(unsigned int encoded_temp, unsigned long long encoded_spat, DATA data) {
+	int k = shard_of(encoded_temp, encoded_spat);
+	std::lock_guard<std::mutex> guard(locks[k]);
+	shards[k]->Delete(encoded_temp, encoded_spat, data);
+	return;
+}
 
-	for(; i <= temp_len; i++){
-		if(temp_internal[u].child[RIGHT_CHILD] != POINTER_NULL_INT)
-			u = temp_internal[u].child[1];
-		else
-			u = temp_internal[u].child[0];
+template<class DATA>
+void Sharded_TST<DATA>::InsertBatch(std::vector<Record>& batch) {
+	// 1 - Partition by shard
+	std::vector<std::vector<Record>> parts(n_shards);
+	for(const Record& record : batch){
+		parts[shard_of(std::get<0>(record), std::get<1>(record))].push_back(record);
 	}
 
-	// reach to the doubly linked list
-	int v = u;
-    while (v != POINTER_NULL_INT) {
-        if (temp_leaf[v].ENCODED_TIME > encoded_start_time) {
-            int closest = v;
-            while (temp_leaf[v].prev != POINTER_NULL_INT && temp_leaf[temp_leaf[v].prev].ENCODED_TIME > encoded_start_time) {
-				v = temp_leaf[v].prev;
-                closest = v;
-            }
-            return closest;
-        }
-		else{
-			if(temp_leaf[v].next == POINTER_NULL_INT) break;
-			else v = temp_leaf[v].next;
+	// 2 - Workers claim whole shards, so each shard is written by one thread at a time
+	std::atomic<int> next(0);
+	auto worker = [&]() {
+		for(int k = next++; k < n_shards; k = next++){
+			if(parts[k].empty()) continue;
+			std::lock_guard<std::mutex> guard(locks[k]);
+			shards[k]->InsertBatch(parts[k]);
 		}
-    }
-
-	return v;
+	};
+	int n_threads = std::min<int>(n_shards, std::max(1u, std::thread::hardware_concurrency()));
+	std::vector<std::thread> workers;
+	for(int t = 1; t < n_threads; t++) workers.emplace_back(worker);
+	worker();
+	for(auto& w : workers) w.join();
+	return;
 }
 
 template<class DATA>
-void TST<DATA>::trav_spat(std::map<int, std::vector<unsigned long long>> LEVEL_MAP, int TIME_IDX, std::vector<DATA>& res) { // Traverse on Spatial Trie
-	int j, bit, lead_3bits;
-	unsigned long long s2;
-	int u;
-
-	for(const auto& LEVEL_S2_PAIR : LEVEL_MAP){
-		int level = LEVEL_S2_PAIR.first;
-		const std::vector<unsigned long long>& s2_values = LEVEL_S2_PAIR.second;
-
-		for(unsigned i = 0; i < s2_values.size(); i++){
-			s2 = s2_values[i] >> (64 - spat_len);
-			u = TIME_IDX;
-			lead_3bits = s2 >> (spat_len - 3) & 0b111;
-			
-			if(temp_leaf[u].child[lead_3bits] == POINTER_NULL_INT) continue; // NOT EXIST
-			else u = temp_leaf[u].child[lead_3bits];
-
-			for(j = 1; j <= level; j++){
-				bit = (s2 >> (spat_len - 3 - 2*j)) & 0b11;
-				if(spat_internal[u].child[bit] == POINTER_NULL_INT) break;
-				u = spat_internal[u].child[bit];
-			}
-			
-			if(j == level+1){ // Result Exist
-				if(level != s2_level){
-					unsigned left_most = u;
-					for(int k=1; k <= s2_level-level; k++){ // Search the left most leaf node
-						if(spat_internal[left_most].child[CHILD_ZERO] != POINTER_NULL_INT)
-							left_most = spat_internal[left_most].child[CHILD_ZERO];
-						else if(spat_internal[left_most].child[CHILD_ONE] != POINTER_NULL_INT)
-							left_most = spat_internal[left_most].child[CHILD_ONE];
-						else if(spat_internal[left_most].child[CHILD_TWO] != POINTER_NULL_INT)
-							left_most = spat_internal[left_most].child[CHILD_TWO];
-						else
-							left_most = spat_internal[left_most].child[CHILD_THIRD];
-					}
-					unsigned right_most = u;
-					for(int k=1; k <= s2_level-level; k++){ // Search the right most leaf node
-						if(spat_internal[right_most].child[CHILD_THIRD] != POINTER_NULL_INT)
-							right_most = spat_internal[right_most].child[CHILD_THIRD];
-						else if(spat_internal[right_most].child[CHILD_TWO] != POINTER_NULL_INT)
-							right_most = spat_internal[right_most].child[CHILD_TWO];
-						else if(spat_internal[right_most].child[CHILD_ONE] != POINTER_NULL_INT)
-							right_most = spat_internal[right_most].child[CHILD_ONE];
-						else
-							right_most = spat_internal[right_most].child[CHILD_ZERO];
-					}
+Spatial_Plan Sharded_TST<DATA>::REC_S2_FINDER(std::vector<double>& lb, std::vector<double>& ru) {
+	return codec.REC_S2_FINDER(lb, ru);
+}
 
-					if(left_most == right_most) spat_leaf[left_most].get_data(res);
-					else{
-						int trav = left_most;
-						do {
-							spat_leaf[trav].get_data(res);
-							trav = spat_leaf[trav].next;
-						} while(trav != spat_leaf[right_most].next);
-					}
-				}
-				else{
-					spat_leaf[u].get_data(res);
-				}			
-			}
-		}
-	}
+template<class DATA>
+Spatial_Plan Sharded_TST<DATA>::REGION_S2_FINDER(const S2Region& region) {
+	return codec.REGION_S2_FINDER(region);
 }
 
 template<class DATA>
-void TST<DATA>::setMaxCells(int new_max) {
-	// You can set the maximum number of S2 cells to search within the queried spatial range.
-	MAXCELL = new_max;
+void Sharded_TST<DATA>::range_search(const Spatial_Plan& plan,
+									unsigned int encoded_start_time, unsigned int encoded_end_time, std::vector<DATA>& res) {
+	// By time: bins in time order, as from one TST. By space: grouped by shard, each in the (time, S2) order of TST::range_search.
+	// No lock is taken: a shard has one writer at a time (its lock holder) and readers never block it.
+	if(mode == SHARD_BY_TIME){
+		for_each_block(encoded_start_time, encoded_end_time, [&](int k, unsigned int start, unsigned int end) {
+			shards[k]->range_search(plan, start, end, res);
+			return true;
+		});
+		return;
+	}
+	for(int k = 0; k < n_shards; k++)
+		shards[k]->range_search(plan, encoded_start_time, encoded_end_time, res);
 	return;
 }
 
 template<class DATA>
-int TST<DATA>::getInter_NodeCount() const {
-	return temp_internal.size() + temp_leaf.size() +
-			spat_internal.size() - D_TEMP_LEAF - D_INTER;
+template<class FN>
+bool Sharded_TST<DATA>::range_visit(const Spatial_Plan& plan, unsigned int encoded_start_time, unsigned int encoded_end_time, FN fn) {
+	if(mode == SHARD_BY_TIME){
+		return for_each_block(encoded_start_time, encoded_end_time, [&](int k, unsigned int start, unsigned int end) {
+			return shards[k]->range_visit(plan, start, end, std::ref(fn));
+		});
+	}
+	for(int k = 0; k < n_shards; k++)
+		if(!shards[k]->range_visit(plan, encoded_start_time, encoded_end_time, std::ref(fn))) return false;
+	return true;
 }
 
 template<class DATA>
-int TST<DATA>::getLeaf_NodeCount() const {
-	return spat_leaf.size() - D_SPAT_LEAF;
+void Sharded_TST<DATA>::knn_search(double lat, double lng, size_t k, unsigned int encoded_start_time, unsigned int encoded_end_time,
+								std::vector<std::pair<DATA, S1Angle>>& res) {
+	// The k nearest of the union are among the k nearest of each shard
+	std::vector<std::pair<DATA, S1Angle>> candidates;
+	for(int i = 0; i < n_shards; i++)
+		shards[i]->knn_search(lat, lng, k, encoded_start_time, encoded_end_time, candidates);
+	std::stable_sort(candidates.begin(), candidates.end(),
+		[](const std::pair<DATA, S1Angle>& a, const std::pair<DATA, S1Angle>& b) { return a.second < b.second; });
+	if(candidates.size() > k) candidates.resize(k);
+	res.insert(res.end(), candidates.begin(), candidates.end());
+	return;
 }
 
 template<class DATA>
-int TST<DATA>::getTotal_NodeCount() const {
-	return getInter_NodeCount() + getLeaf_NodeCount();
+size_t Sharded_TST<DATA>::range_count(const Spatial_Plan& plan, unsigned int encoded_start_time, unsigned int encoded_end_time) {
+	size_t total = 0;
+	for(int k = 0; k < n_shards; k++)
+		total += shards[k]->range_count(plan, encoded_start_time, encoded_end_time);
+	return total;
 }
 
 template<class DATA>
-int TST<DATA>::get_DataCount() const {
-	int total_size = 0;
-    for(unsigned i = 0; i < spat_leaf.size(); i++){
-        auto data = spat_leaf[i];
-        total_size += data.size();
-    }
-	return total_size;
+void Sharded_TST<DATA>::range_search(const std::map<int, std::vector<unsigned long long>>& S2_LEVEL_MAP,
+									unsigned int encoded_start_time, unsigned int encoded_end_time, std::vector<DATA>& res) {
+	range_search(codec.compile_plan(S2_LEVEL_MAP), encoded_start_time, encoded_end_time, res);
 }
 
 template<class DATA>
-double TST<DATA>::get_size() const {
-    size_t temp_internal_bytes = temp_internal.size() * sizeof(Node_T);
-    size_t temp_leaf_bytes     = temp_leaf.size() * sizeof(Linked_Node);
-    size_t spat_internal_bytes = spat_internal.size() * sizeof(Node_S);
-    size_t spat_leaf_bytes     = spat_leaf.size() * sizeof(Data_Node<DATA>);
-
-    size_t total_bytes = temp_internal_bytes + temp_leaf_bytes + 
-                         spat_internal_bytes + spat_leaf_bytes;
+void Sharded_TST<DATA>::setMaxCells(int new_max) {
+	codec.setMaxCells(new_max);
+	return;
+}
 
-    return total_bytes / (1024.0 * 1024.0);  // Convert to MB
+template<class DATA>
+int Sharded_TST<DATA>::shard_count() const {
+	return n_shards;
 }
 
 template<class DATA>
-int TST<DATA>::getTemp_len() const {
-	return temp_len;
+TST<DATA>& Sharded_TST<DATA>::shard(int k) {
+	return *shards[k];
 }
 
 template<class DATA>
-int TST<DATA>::getSpat_len() const {
-	return spat_len;
+int Sharded_TST<DATA>::get_DataCount() {
+	int count = 0;
+	for(int k = 0; k < n_shards; k++){
+		std::lock_guard<std::mutex> guard(locks[k]);
+		count += shards[k]->get_DataCount();
+	}
+	return count;
 }
 
 template<class DATA>
-int TST<DATA>::getTotal_len() const {
-	return total_len;
+double Sharded_TST<DATA>::get_size() {
+	double size = 0;
+	for(int k = 0; k < n_shards; k++){
+		std::lock_guard<std::mutex> guard(locks[k]);
+		size += shards[k]->get_size();
+	}
+	return size;
 }
 
+/* CSV Loader */
+template<class T>
+class Ring_Queue { // Bounded lock-free queue between one producer thread and one consumer thread
+public:
+	explicit Ring_Queue(size_t capacity) : slots(capacity + 1) {}
+
+	bool try_push(T& item) { // Moves item in, unless the queue is full
+		size_t tail = back.load(std::memory_order_relaxed);
+		size_t next = (tail + 1 == slots.size()) ? 0 : tail + 1;
+		if(next == front.load(std::memory_order_acquire)) return false;
+		slots[tail] = std::move(item);
+		back.store(next, std::memory_order_release);
+		return true;
+	}
+
+	bool try_pop(T& item) { // Moves the oldest item out, unless the queue is empty
+		size_t head = front.load(std::memory_order_relaxed);
+		if(head == back.load(std::memory_order_acquire)) return false;
+		item = std::move(slots[head]);
+		front.store((head + 1 == slots.size()) ? 0 : head + 1, std::memory_order_release);
+		return true;
+	}
+
+	size_t size() const { // Approximate while the other side runs
+		size_t head = front.load(std::memory_order_acquire), tail = back.load(std::memory_order_acquire);
+		return (tail >= head) ? tail - head : tail + slots.size() - head;
+	}
+
+private:
+	std::vector<T> slots; // One slot stays empty, to tell a full queue from an empty one
+	alignas(64) std::atomic<size_t> front{0}; // Next slot to pop (consumer)
+	alignas(64) std::atomic<size_t> back{0}; // Next slot to push (producer)
+};
+
+struct Load_Options {
+	int time_columns = 4; // Integer columns before latitude and longitude: year, month, day, hour, ...
+	int threads = 0; // Encoder workers that parse and encode chunks (0: all cores)
+	size_t chunk_bytes = 4 << 20; // Lines move between the stages in chunks of about this many bytes
+	size_t queue_chunks = 4; // Capacity of each queue between two stages; a stage waits while its output is full
+};
+
+struct Stage_Stats { // One stage of the CSV_Loader pipeline (encoder: all workers together)
+	size_t chunks = 0;
+	size_t bytes = 0;
+	size_t records = 0; // 0 for the reader, which does not parse
+	double busy_ms = 0; // Working on chunks (summed over workers)
+	double wait_ms = 0; // Blocked on an empty input or a full output queue
+	size_t max_depth = 0; // Input queue depth seen when taking a chunk: deepest ...
+	double mean_depth = 0; // ... and on average
+
+	double throughput() const { return busy_ms > 0 ? bytes / busy_ms / 1e3 : 0; } // MB/s of busy time
+};
+
+struct Pipeline_Stats {
+	Stage_Stats reader, encoder, inserter;
+};
+
+class CSV_Loader { // Maps a "year,month,day,hour,lat,lng" file and loads it through a parse/encode/insert pipeline
+public:
+	struct Chunk { // One run of whole lines, parsed into columns and encoded
+		const char* begin = nullptr; // nullptr: end of the file
+		const char* end = nullptr;
+		size_t lines = 0; // # of lines, including blank ones
+		size_t bad_line = 0; // First malformed line (from 1), 0 if none
+		std::vector<std::vector<int>> fields; // One column per temporal field
+		std::vector<double> lat, lng;
+		std::vector<unsigned int> encoded_temp;
+		std::vector<unsigned long long> encoded_spat;
+	};
+
+	explicit CSV_Loader(const std::string& path, const Load_Options& options = Load_Options())
+		: options(options), addr(MAP_FAILED), length(0) {
+		if(options.time_columns < 1 || options.time_columns > 6){
+			throw std::invalid_argument("A CSV file has 1 to 6 temporal columns.");
+		}
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if(fd < 0){
+			throw std::runtime_error("Cannot open CSV file: " + path);
+		}
+		struct stat st;
+		if(fstat(fd, &st) != 0){
+			::close(fd);
+			throw std::runtime_error("Cannot read CSV file: " + path);
+		}
+		length = st.st_size;
+		if(length > 0){
+			addr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+		}
+		::close(fd);
+		if(length > 0 && addr == MAP_FAILED){
+			throw std::runtime_error("Cannot map CSV file: " + path);
+		}
+		if(length > 0) madvise(addr, length, MADV_SEQUENTIAL);
+	}
+
+	~CSV_Loader() {
+		if(addr != MAP_FAILED) munmap(addr, length);
+	}
+
+	CSV_Loader(const CSV_Loader&) = delete;
+	CSV_Loader& operator=(const CSV_Loader&) = delete;
+
+	bool next_chunk(size_t& offset, Chunk& chunk) const { // The chunk at offset, about chunk_bytes up to a newline
+		if(offset >= length) return false;
+		const char* file = static_cast<const char*>(addr);
+		size_t end = std::min(length, offset + std::max<size_t>(options.chunk_bytes, 1));
+		if(end < length){
+			const void* eol = memchr(file + end - 1, '\n', length - end + 1);
+			end = eol ? (const char*)eol - file + 1 : length;
+		}
+		chunk = Chunk();
+		chunk.begin = file + offset;
+		chunk.end = file + end;
+		offset = end;
+		return true;
+	}
+
+	std::vector<Chunk> split() const { // The whole file as chunks
+		std::vector<Chunk> chunks;
+		Chunk chunk;
+		for(size_t offset = 0; next_chunk(offset, chunk); ) chunks.push_back(std::move(chunk));
+		return chunks;
+	}
+
+	void parse(Chunk& chunk) const { // Stops at the first malformed line (bad_line)
+		// from_chars rounds like strtod, so every coordinate matches what operator>> reads
+		int columns = options.time_columns;
+		chunk.fields.assign(columns, std::vector<int>());
+		size_t estimate = (chunk.end - chunk.begin) / 24 + 1;
+		for(auto& field : chunk.fields) field.reserve(estimate);
+		chunk.lat.reserve(estimate);
+		chunk.lng.reserve(estimate);
+
+		const char* p = chunk.begin;
+		while(p < chunk.end){
+			const char* eol = (const char*)memchr(p, '\n', chunk.end - p);
+			if(!eol) eol = chunk.end;
+			chunk.lines++;
+			const char* q = skip_space(p, eol);
+			p = eol + 1;
+			if(q == eol || (*q == '\r' && q + 1 == eol)) continue; // Blank line
+
+			bool ok = true;
+			for(int c = 0; c < columns && ok; c++){
+				int value = 0;
+				auto result = std::from_chars(skip_plus(q, eol), eol, value);
+				ok = (result.ec == std::errc()) && (q = expect_comma(result.ptr, eol)) != nullptr;
+				if(ok) chunk.fields[c].push_back(value);
+			}
+			double lat = 0, lng = 0;
+			if(ok){
+				auto result = std::from_chars(skip_plus(q, eol), eol, lat);
+				ok = (result.ec == std::errc()) && (q = expect_comma(result.ptr, eol)) != nullptr;
+			}
+			if(ok){
+				auto result = std::from_chars(skip_plus(q, eol), eol, lng);
+				q = skip_space(result.ptr, eol);
+				ok = (result.ec == std::errc()) && (q == eol || (*q == '\r' && q + 1 == eol));
+			}
+			if(!ok){
+				chunk.bad_line = chunk.lines;
+				return;
+			}
+			chunk.lat.push_back(lat);
+			chunk.lng.push_back(lng);
+		}
+	}
+
+	template<class INDEX>
+	void encode(INDEX& index, Chunk& chunk) const { // Batch encoders only read the index, so chunks may be encoded concurrently
+		size_t n = chunk.lat.size();
+		const int* columns[6] = {nullptr, nullptr, nullptr, nullptr, nullptr, nullptr};
+		for(int c = 0; c < options.time_columns; c++) columns[c] = chunk.fields[c].data();
+		chunk.encoded_temp.resize(n);
+		chunk.encoded_spat.resize(n);
+		index.time_encoder_batch(n, columns, chunk.encoded_temp.data());
+		index.space_encoder_batch(n, chunk.lat.data(), chunk.lng.data(), chunk.encoded_spat.data());
+	}
+
+	template<class INDEX, class VALUE_OF>
+	size_t load(INDEX& index, VALUE_OF value_of) { // value_of(record number from 1) -> DATA, called on this thread in file order
+		// A pipeline: a reader thread cuts the mapping into chunks, encoder workers parse and encode them, and this
+		// thread inserts them (the index keeps its single writer). Chunk c goes to worker c % n and comes back through
+		// that worker's own pair of rings, so every ring has one producer and one consumer, and file order holds.
+		auto clock_start = std::chrono::steady_clock::now();
+		stats = Pipeline_Stats();
+		records = 0;
+		check_columns(index);
+
+		int n_workers = options.threads > 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+		size_t capacity = std::max<size_t>(options.queue_chunks, 1);
+		std::vector<std::unique_ptr<Ring_Queue<Chunk>>> to_encode, to_insert;
+		for(int k = 0; k < n_workers; k++){
+			to_encode.emplace_back(new Ring_Queue<Chunk>(capacity));
+			to_insert.emplace_back(new Ring_Queue<Chunk>(capacity));
+		}
+		std::vector<Stage_Stats> worker_stats(n_workers);
+		std::atomic<bool> stop(false);
+
+		auto reader = [&]() {
+			Stage_Stats& stage = stats.reader;
+			size_t offset = 0;
+			Chunk chunk;
+			for(size_t c = 0; ; c++){
+				auto start = std::chrono::steady_clock::now();
+				bool more = next_chunk(offset, chunk);
+				if(more){ // Start reading the chunk's pages before a worker faults on them
+					uintptr_t page = (uintptr_t)chunk.begin & ~(uintptr_t)(sysconf(_SC_PAGESIZE) - 1);
+					madvise((void*)page, (uintptr_t)chunk.end - page, MADV_WILLNEED);
+				}
+				stage.busy_ms += elapsed_ms(start);
+				if(!more) break;
+				stage.chunks++;
+				stage.bytes += chunk.end - chunk.begin;
+				if(!push(*to_encode[c % n_workers], chunk, stop, stage)) return;
+			}
+			for(int k = 0; k < n_workers; k++){ // End of the file, to every worker
+				Chunk end;
+				if(!push(*to_encode[k], end, stop, stage)) return;
+			}
+		};
+
+		auto worker = [&](int k) {
+			Stage_Stats& stage = worker_stats[k];
+			Chunk chunk;
+			while(pop(*to_encode[k], chunk, stop, stage)){
+				if(chunk.begin != nullptr){
+					auto start = std::chrono::steady_clock::now();
+					parse(chunk);
+					if(chunk.bad_line == 0) encode(index, chunk);
+					stage.busy_ms += elapsed_ms(start);
+					stage.chunks++;
+					stage.bytes += chunk.end - chunk.begin;
+					stage.records += chunk.lat.size();
+				}
+				bool end = (chunk.begin == nullptr);
+				if(!push(*to_insert[k], chunk, stop, stage) || end) return;
+			}
+		};
+
+		std::vector<std::thread> threads;
+		threads.emplace_back(reader);
+		for(int k = 0; k < n_workers; k++) threads.emplace_back(worker, k);
+		auto join = [&]() {
+			for(auto& thread : threads) thread.join();
+			threads.clear();
+		};
+
+		try {
+			Stage_Stats& stage = stats.inserter;
+			size_t lines = 0;
+			typename INDEX::Record record;
+			std::vector<typename INDEX::Record> batch;
+			Chunk chunk;
+			for(size_t c = 0; pop(*to_insert[c % n_workers], chunk, stop, stage) && chunk.begin != nullptr; c++){
+				if(chunk.bad_line){
+					throw std::runtime_error("Malformed CSV line " + std::to_string(lines + chunk.bad_line) + ".");
+				}
+				auto start = std::chrono::steady_clock::now();
+				batch.clear();
+				batch.reserve(chunk.lat.size());
+				for(size_t k = 0; k < chunk.lat.size(); k++){
+					std::get<0>(record) = chunk.encoded_temp[k];
+					std::get<1>(record) = chunk.encoded_spat[k];
+					std::get<2>(record) = value_of(++records);
+					batch.push_back(record);
+				}
+				if(!batch.empty()){
+					last = std::make_pair(std::get<0>(batch.back()), std::get<1>(batch.back()));
+					index.InsertBatch(batch);
+				}
+				lines += chunk.lines;
+				stage.busy_ms += elapsed_ms(start);
+				stage.chunks++;
+				stage.bytes += chunk.end - chunk.begin;
+				stage.records += batch.size();
+			}
+		} catch(...) {
+			stop = true; // Wakes every stage that waits on a queue
+			join();
+			throw;
+		}
+		join();
+
+		for(const Stage_Stats& part : worker_stats){ // The encoder stage is all workers together
+			Stage_Stats& stage = stats.encoder;
+			stage.mean_depth = (stage.mean_depth * stage.chunks + part.mean_depth * part.chunks) / std::max<size_t>(stage.chunks + part.chunks, 1);
+			stage.max_depth = std::max(stage.max_depth, part.max_depth);
+			stage.chunks += part.chunks;
+			stage.bytes += part.bytes;
+			stage.records += part.records;
+			stage.busy_ms += part.busy_ms;
+			stage.wait_ms += part.wait_ms;
+		}
+		total_ms = elapsed_ms(clock_start);
+		return records;
+	}
+
+	size_t getRecord_count() const { return records; } // Getter for # of records of the last load
+	double getParse_time() const { return stats.encoder.busy_ms; } // Getter for ms spent parsing and encoding (all workers)
+	double getInsert_time() const { return stats.inserter.busy_ms; } // Getter for ms spent inserting
+	double getTotal_time() const { return total_ms; } // Getter for ms of the whole load
+	const Pipeline_Stats& getPipeline_stats() const { return stats; } // Getter for per-stage throughput and queue depths
+	std::pair<unsigned int, unsigned long long> last_key() const { return last; } // Encoded (time, space) of the last record
+
+private:
+	Load_Options options;
+	void* addr;
+	size_t length;
+	size_t records = 0;
+	double total_ms = 0;
+	Pipeline_Stats stats;
+	std::pair<unsigned int, unsigned long long> last{0, 0};
+
+	static double elapsed_ms(std::chrono::steady_clock::time_point start) {
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	template<class TRY>
+	static bool wait_for(TRY attempt, const std::atomic<bool>& stop, Stage_Stats& stage) { // false once stopped
+		if(attempt()) return true;
+		auto start = std::chrono::steady_clock::now();
+		for(int spin = 0; !attempt(); spin++){ // Backpressure: yield first, then sleep, so idle stages leave the cores
+			if(stop.load(std::memory_order_relaxed)) return false;
+			if(spin < 64) std::this_thread::yield();
+			else std::this_thread::sleep_for(std::chrono::microseconds(50));
+		}
+		stage.wait_ms += elapsed_ms(start);
+		return true;
+	}
+
+	static bool push(Ring_Queue<Chunk>& queue, Chunk& chunk, const std::atomic<bool>& stop, Stage_Stats& stage) {
+		return wait_for([&]() { return queue.try_push(chunk); }, stop, stage);
+	}
+
+	static bool pop(Ring_Queue<Chunk>& queue, Chunk& chunk, const std::atomic<bool>& stop, Stage_Stats& stage) {
+		size_t depth = queue.size();
+		if(!wait_for([&]() { return queue.try_pop(chunk); }, stop, stage)) return false;
+		if(chunk.begin != nullptr){ // Running mean over the chunks taken so far
+			stage.max_depth = std::max(stage.max_depth, depth);
+			stage.mean_depth += (depth - stage.mean_depth) / (stage.chunks + 1);
+		}
+		return true;
+	}
+
+	static const char* skip_space(const char* p, const char* end) {
+		while(p < end && (*p == ' ' || *p == '\t')) p++;
+		return p;
+	}
+
+	static const char* skip_plus(const char* p, const char* end) { // from_chars takes '-' but not '+'; "+-1" stays malformed
+		return (p + 1 < end && *p == '+' && p[1] != '-') ? p + 1 : p;
+	}
+
+	static const char* expect_comma(const char* p, const char* end) { // Position after the comma, or nullptr
+		p = skip_space(p, end);
+		if(p == end || *p != ',') return nullptr;
+		return skip_space(p + 1, end);
+	}
+
+	template<class INDEX>
+	void check_columns(INDEX& index) const { // Before any thread starts: the file must have every field the resolution encodes
+		const int* columns[6] = {nullptr, nullptr, nullptr, nullptr, nullptr, nullptr};
+		static const int none = 0;
+		for(int c = 0; c < options.time_columns; c++) columns[c] = &none;
+		try {
+			index.time_encoder_batch(0, columns, nullptr);
+		} catch(const std::invalid_argument&) {
+			throw std::invalid_argument("The temporal resolution of the index needs more than " +
+										std::to_string(options.time_columns) + " temporal columns (Load_Options::time_columns).");
+		}
+	}
+};
 
 
 }